@@ -1 +1 @@
-g++ src\PathTracerCpp.cpp -o H:\Exes\PathTracerC\PathTracerCpp.exe
\ No newline at end of file
+g++ -O2 -pthread src\PathTracerCpp.cpp -o H:\Exes\PathTracerC\PathTracerCpp.exe
\ No newline at end of file
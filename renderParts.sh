@@ -0,0 +1,19 @@
+#!/bin/sh
+# Renders the card with N worker processes on this machine and merges their
+# partial accumulations. Extra arguments go to every process, e.g.
+#   ./renderParts.sh 4 -w 1920 -h 1080 -s 64 -o card.bmp
+# Parts for other hosts are run the same way with --part K/N and their
+# .acc files copied back before the merge.
+N=${1:-4}
+[ $# -gt 0 ] && shift
+EXE=${PATHTRACER:-./PathTracerCpp}
+i=0
+while [ $i -lt $N ]; do
+  "$EXE" "$@" -t 1 --part $i/$N --checkpoint part$i.acc &
+  i=$((i + 1))
+done
+wait
+files=""
+i=0
+while [ $i -lt $N ]; do files="$files part$i.acc"; i=$((i + 1)); done
+"$EXE" "$@" --merge $files
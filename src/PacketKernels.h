@@ -0,0 +1,236 @@
+// Ray-packet kernels. PathTracerCpp.cpp includes this file once per
+// instruction set, each time inside its own namespace and #pragma GCC
+// target, and picks one at startup. There is deliberately no include guard.
+
+// Eight float lanes. With PACKET_AVX this is a single AVX register,
+// otherwise a pair of SSE registers. Comparisons return masks with
+// all bits set in the lanes where they hold.
+struct F8 {
+#if defined(PACKET_AVX)
+  __m256 v;
+
+  F8() {}
+  F8(__m256 a) : v(a) {}
+  F8(float a) : v(_mm256_set1_ps(a)) {}
+
+  static F8 load(const float* p) { return _mm256_loadu_ps(p); }
+  void store(float* p) { _mm256_storeu_ps(p, v); }
+
+  F8 operator+(F8 r) { return _mm256_add_ps(v, r.v); }
+  F8 operator-(F8 r) { return _mm256_sub_ps(v, r.v); }
+  F8 operator*(F8 r) { return _mm256_mul_ps(v, r.v); }
+  F8 operator/(F8 r) { return _mm256_div_ps(v, r.v); }
+  F8 operator<(F8 r) { return _mm256_cmp_ps(v, r.v, _CMP_LT_OQ); }
+  F8 operator>(F8 r) { return _mm256_cmp_ps(v, r.v, _CMP_GT_OQ); }
+  F8 operator&(F8 r) { return _mm256_and_ps(v, r.v); }
+  F8 operator|(F8 r) { return _mm256_or_ps(v, r.v); }
+  F8 andNot(F8 r) { return _mm256_andnot_ps(r.v, v); } // this & ~r
+  int mask() { return _mm256_movemask_ps(v); }
+#else
+  __m128 lo, hi;
+
+  F8() {}
+  F8(__m128 a, __m128 b) : lo(a), hi(b) {}
+  F8(float a) : lo(_mm_set1_ps(a)), hi(lo) {}
+
+  static F8 load(const float* p) { return F8(_mm_loadu_ps(p), _mm_loadu_ps(p + 4)); }
+  void store(float* p) { _mm_storeu_ps(p, lo); _mm_storeu_ps(p + 4, hi); }
+
+  F8 operator+(F8 r) { return F8(_mm_add_ps(lo, r.lo), _mm_add_ps(hi, r.hi)); }
+  F8 operator-(F8 r) { return F8(_mm_sub_ps(lo, r.lo), _mm_sub_ps(hi, r.hi)); }
+  F8 operator*(F8 r) { return F8(_mm_mul_ps(lo, r.lo), _mm_mul_ps(hi, r.hi)); }
+  F8 operator/(F8 r) { return F8(_mm_div_ps(lo, r.lo), _mm_div_ps(hi, r.hi)); }
+  F8 operator<(F8 r) { return F8(_mm_cmplt_ps(lo, r.lo), _mm_cmplt_ps(hi, r.hi)); }
+  F8 operator>(F8 r) { return F8(_mm_cmpgt_ps(lo, r.lo), _mm_cmpgt_ps(hi, r.hi)); }
+  F8 operator&(F8 r) { return F8(_mm_and_ps(lo, r.lo), _mm_and_ps(hi, r.hi)); }
+  F8 operator|(F8 r) { return F8(_mm_or_ps(lo, r.lo), _mm_or_ps(hi, r.hi)); }
+  F8 andNot(F8 r) { return F8(_mm_andnot_ps(r.lo, lo), _mm_andnot_ps(r.hi, hi)); }
+  int mask() { return _mm_movemask_ps(lo) | _mm_movemask_ps(hi) << 4; }
+#endif
+};
+
+#if defined(PACKET_AVX)
+F8 min(F8 l, F8 r) { return _mm256_min_ps(l.v, r.v); }
+F8 max(F8 l, F8 r) { return _mm256_max_ps(l.v, r.v); }
+F8 sqrt(F8 a) { return _mm256_sqrt_ps(a.v); }
+F8 rsqrtEstimate(F8 a) { return _mm256_rsqrt_ps(a.v); }
+// Exact for |a| < 2^31, which covers every coordinate in the room.
+F8 trunc(F8 a) { return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(a.v)); }
+#else
+F8 min(F8 l, F8 r) { return F8(_mm_min_ps(l.lo, r.lo), _mm_min_ps(l.hi, r.hi)); }
+F8 max(F8 l, F8 r) { return F8(_mm_max_ps(l.lo, r.lo), _mm_max_ps(l.hi, r.hi)); }
+F8 sqrt(F8 a) { return F8(_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)); }
+F8 rsqrtEstimate(F8 a) { return F8(_mm_rsqrt_ps(a.lo), _mm_rsqrt_ps(a.hi)); }
+F8 trunc(F8 a) {
+  return F8(_mm_cvtepi32_ps(_mm_cvttps_epi32(a.lo)),
+            _mm_cvtepi32_ps(_mm_cvttps_epi32(a.hi)));
+}
+#endif
+F8 abs(F8 a) { return a.andNot(F8(-0.f)); }
+// Eight-lane RSqrt(), with the same error bound.
+F8 rsqrt(F8 a) {
+  F8 y = rsqrtEstimate(a);
+  return y * (F8(1.5f) - F8(.5f) * a * y * y);
+}
+// Lanes of mask take a, the rest take b.
+F8 select(F8 mask, F8 a, F8 b) { return (a & mask) | b.andNot(mask); }
+
+// Structure-of-arrays vector: lane i of x, y and z is one Vec.
+struct Vec8 {
+  F8 x, y, z;
+
+  Vec8() {}
+  Vec8(F8 a, F8 b, F8 c) : x(a), y(b), z(c) {}
+  Vec8(Vec v) : x(v.x), y(v.y), z(v.z) {}
+
+  Vec8 operator+(Vec8 r) { return Vec8(x + r.x, y + r.y, z + r.z); }
+  Vec8 operator*(F8 r) { return Vec8(x * r, y * r, z * r); }
+  F8 operator%(Vec8 r) { return x * r.x + y * r.y + z * r.z; }
+
+  static Vec8 load(Vec v[8]) {
+    float x[8], y[8], z[8];
+    for (int i = 0; i < 8; ++i) x[i] = v[i].x, y[i] = v[i].y, z[i] = v[i].z;
+    return Vec8(F8::load(x), F8::load(y), F8::load(z));
+  }
+  void store(Vec v[8]) {
+    float px[8], py[8], pz[8];
+    x.store(px), y.store(py), z.store(pz);
+    for (int i = 0; i < 8; ++i) v[i] = Vec(px[i], py[i], pz[i]);
+  }
+};
+
+F8 BoxTest(Vec8 position, Vec lowerLeft, Vec upperRight) {
+  return F8(0) - min(min(min(position.x - lowerLeft.x, F8(upperRight.x) - position.x),
+                         min(position.y - lowerLeft.y, F8(upperRight.y) - position.y)),
+                     min(position.z - lowerLeft.z, F8(upperRight.z) - position.z));
+}
+
+F8 BoundsDistanceSq(Bounds &bounds, F8 x, F8 y) {
+  F8 dx = max(max(F8(bounds.minX) - x, x - bounds.maxX), 0);
+  F8 dy = max(max(F8(bounds.minY) - y, y - bounds.maxY), 0);
+  return dx * dx + dy * dy;
+}
+
+F8 GlyphDistanceSq(Glyph &glyph, F8 x, F8 y, F8 best) {
+  for (int i = glyph.first; i < glyph.first + glyph.count; ++i) {
+    Segment &s = scene.segments[i];
+    F8 bx = x - s.beginX, by = y - s.beginY;
+    F8 t = min(max((bx * s.edgeX + by * s.edgeY) * s.invLengthSq, 0), 1);
+    F8 ox = bx - t * s.edgeX, oy = by - t * s.edgeY;
+    best = min(best, ox * ox + oy * oy);
+  }
+  if (glyph.curved) {
+    // Half ring right of the center, the ring's end caps left of it.
+    F8 ox = x - glyph.curveX, oy = y - glyph.curveY;
+    F8 ring = abs(sqrt(ox * ox + oy * oy) - 2);
+    F8 cy = oy + select(oy > 0, -2, 2);
+    F8 cap = sqrt(ox * ox + cy * cy);
+    F8 d = select(ox > 0, ring, cap);
+    best = min(best, d * d);
+  }
+  return best;
+}
+
+// Packet version of QueryDatabase(). hitType receives HIT_* values as floats.
+// A glyph is skipped only when it is out of reach for all eight lanes.
+F8 QueryDatabase8(Vec8 position, F8 &hitType) {
+  rayStats.queries += 8;
+  F8 ax = abs(position.x);
+  Vec8 plank(ax - trunc(ax * .125f) * 8, position.y, position.z); // fmodf(|x|, 8)
+  F8 distance = min(F8(0) - min(BoxTest(position, Vec(-30, -.5, -30), Vec(30, 18, 30)),
+                                BoxTest(position, Vec(-25, 17, -25), Vec(25, 20, 25))),
+                    BoxTest(plank, Vec(1.5, 18.5, -25), Vec(6.5, 20, 25)));
+  hitType = HIT_WALL;
+
+  F8 sun = F8(19.9f) - position.y;
+  F8 closer = sun < distance;
+  distance = select(closer, sun, distance);
+  hitType = select(closer, HIT_SUN, hitType);
+
+  F8 cutoff = distance + .501f, best = cutoff * cutoff;
+  if (!(BoundsDistanceSq(scene.bounds, position.x, position.y) < best).mask())
+    return distance;
+  for (int g = 0; g < 5; ++g) {
+    Glyph &glyph = scene.glyphs[g];
+    if ((BoundsDistanceSq(glyph.bounds, position.x, position.y) < best).mask())
+      best = GlyphDistanceSq(glyph, position.x, position.y, best);
+  }
+
+  // pow(d^8 + z^8, 1/8) with multiplications and three square roots. Lanes
+  // still at the cutoff come out above distance and keep the room or sun.
+  F8 d4 = best * best, z2 = position.z * position.z, z4 = z2 * z2;
+  F8 letter = sqrt(sqrt(sqrt(d4 * d4 + z4 * z4))) - .5f;
+  F8 keep = distance < letter; // Letters win ties.
+  hitType = select(keep, hitType, HIT_LETTER);
+  return select(keep, distance, letter);
+}
+
+// Marches eight rays at once with the same stepping rules as RayMarching().
+// Lanes leave the loop as soon as they hit or escape; the packet stops when
+// every lane is done. Only the lanes set in laneMask are marched.
+void RayMarching8(Vec8 origin, Vec8 direction, int laneMask, Hit hits[8]) {
+  F8 totalD = 0, noHitCount = 0, hitType = HIT_NONE, hitD = 0, hitMask = 0;
+  float lanes[8];
+  for (int i = 0; i < 8; ++i) lanes[i] = laneMask >> i & 1;
+  F8 active = F8::load(lanes) > 0;
+
+  Vec8 hitPos = origin;
+  rayStats.rays += __builtin_popcount(laneMask);
+  while (active.mask()) {
+    rayStats.steps += __builtin_popcount(active.mask());
+    Vec8 position = origin + direction * totalD;
+    F8 type, d = QueryDatabase8(position, type);
+    F8 near = d < .01f;
+    noHitCount = noHitCount + (F8(1) & active.andNot(near));
+    F8 done = active & (near | (noHitCount > 99.5f));
+    hitType = select(done, type, hitType);
+    hitD = select(done, d, hitD);
+    hitPos = Vec8(select(done, position.x, hitPos.x),
+                  select(done, position.y, hitPos.y),
+                  select(done, position.z, hitPos.z));
+    hitMask = hitMask | done;
+    active = active.andNot(done);
+    totalD = totalD + (d & active);
+    active = active & (totalD < 100);
+  }
+  if (!hitMask.mask()) {
+    for (int i = 0; i < 8; ++i) hits[i].type = HIT_NONE;
+    return;
+  }
+
+  // Forward-difference normals for the lanes that hit.
+  F8 ignored, eps = .01f;
+  Vec8 normal(QueryDatabase8(Vec8(hitPos.x + eps, hitPos.y, hitPos.z), ignored) - hitD,
+              QueryDatabase8(Vec8(hitPos.x, hitPos.y + eps, hitPos.z), ignored) - hitD,
+              QueryDatabase8(Vec8(hitPos.x, hitPos.y, hitPos.z + eps), ignored) - hitD);
+#if defined(FAST_MATH)
+  normal = normal * rsqrt(normal % normal);
+#else
+  normal = normal * (F8(1) / sqrt(normal % normal));
+#endif
+  float types[8];
+  Vec positions[8], normals[8];
+  (hitType & hitMask).store(types);
+  hitPos.store(positions);
+  normal.store(normals);
+  for (int i = 0; i < 8; ++i) {
+    hits[i].type = (int)types[i];
+    hits[i].position = positions[i];
+    hits[i].normal = normals[i];
+  }
+}
+
+// Entry points on plain arrays, so callers need not know this variant's F8.
+void MarchPacket(Vec origins[8], Vec directions[8], int laneMask, Hit hits[8]) {
+  RayMarching8(Vec8::load(origins), Vec8::load(directions), laneMask, hits);
+}
+
+void QueryPacket(Vec positions[8], float distances[8], float hitTypes[8]) {
+  F8 types;
+  QueryDatabase8(Vec8::load(positions), types).store(distances);
+  types.store(hitTypes);
+}
+
+void RSqrtPacket(float values[8]) {
+  rsqrt(F8::load(values)).store(values);
+}
@@ -8,7 +8,6 @@ const int HIT_NONE = 0;
 const int HIT_LETTER = 1;
 const int HIT_WALL = 2;
 const int HIT_SUN = 3;
-const float RAND_MAX_FLOAT = (float)RAND_MAX;
 
 typedef unsigned char byte;
 typedef struct {
@@ -47,7 +46,29 @@ float dotProduct(Vec a, Vec b) {
 
 float min(float l, float r) { return l < r ? l : r; }
 
-float randomVal() { return (float) rand() / RAND_MAX_FLOAT; }
+// Counter-based random numbers: every value is a hash of the pixel, sample,
+// bounce and dimension it is used for, with no hidden global state.
+typedef struct {
+    unsigned int pixel, sample;
+} RandomKey;
+
+// "lowbias32" integer finalizer by Chris Wellons.
+unsigned int hash32(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Bounce 0 is the camera jitter, bounces 1..n are the ones in trace().
+float randomVal(RandomKey key, int bounce, int dimension) {
+    unsigned int h = hash32(key.pixel);
+    h = hash32(h ^ key.sample);
+    h = hash32(h ^ (bounce << 16 | dimension));
+    return (h >> 8) * (1.f / 16777216);
+}
 
 // Rectangle CSG equation. Returns minimum signed distance from
 // space carved by
@@ -129,7 +150,7 @@ void dbg(Vec a) {
     printf("dbg %.6f %.6f %.6f\n", a.x, a.y, a.z);
 }
 
-Vec trace(Vec position, Vec direction) {   
+Vec trace(Vec position, Vec direction, RandomKey key) {   
     Vec sampledPosition = vec(0, 0, 0);
     Vec normal = vec(0, 0, 0);
     Vec color = vec(0, 0, 0);
@@ -138,7 +159,7 @@ Vec trace(Vec position, Vec direction) {
     static const Vec otherColor = {.x = 50.0, .y = 400.0, .z = 100.0};
     static const Vec sunColor = {.x = 50.0, .y = 80.0, .z = 100.0};
     //dbg(lightDirection);
-    for (int bounceCount = 3; bounceCount--;) {
+    for (int bounce = 1; bounce <= 3; ++bounce) {
         int hitType = rayMarching(position, direction, &sampledPosition, &normal);
 
         if (hitType == HIT_NONE) break; // No hit. This is over, return color.
@@ -148,8 +169,8 @@ Vec trace(Vec position, Vec direction) {
             attenuation *= 0.2; // Attenuation via distance traveled.
         } else if (hitType == HIT_WALL) { // Wall hit uses color yellow?
             float incidence = dotProduct(normal, lightDirection);
-            float p = 6.283185 * randomVal();
-            float c = randomVal();
+            float p = 6.283185 * randomVal(key, bounce, 0);
+            float c = randomVal(key, bounce, 1);
             float s = sqrtf(1 - c);
             float g = normal.z < 0 ? -1 : 1;
             float u = -1 / (g + normal.z);
@@ -260,11 +281,13 @@ int main() {
     for (int y = h; y--;)
         for (int x = w; x--;) {            
             Vec color = vec(0, 0, 0);
+            RandomKey key = {.pixel = w*y + x, .sample = 0};
             for (int p = samplesCount; --p;) {
-                Vec a = plus(factor(dirLeft, (x - w/2) * randomVal()), factor(dirUp, (y - h/2) * randomVal()));             
+                key.sample = p;
+                Vec a = plus(factor(dirLeft, (x - w/2) * randomVal(key, 0, 0)), factor(dirUp, (y - h/2) * randomVal(key, 0, 1)));
                 Vec b = normalize(plus(goal, a));
                 dbg(b);
-                Vec diff = trace(position, b);
+                Vec diff = trace(position, b, key);
                 color = plus(color, diff);
                 //dbg(diff);
             }
@@ -1,10 +1,63 @@
-#include <stdlib.h> // card > pixar.ppm
+#include <stdlib.h> // card -o - > pixar.ppm
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <ctype.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
+// The SSE/AVX packet kernels and the hardware rsqrt estimate are x86 only.
+// Elsewhere the scalar renderer builds alone and --simd is unavailable.
+#if defined(__x86_64__) || defined(__i386__)
+#define X86
+#include <immintrin.h>
+#endif
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <string>
 
 
 typedef unsigned char byte;
 
+// Fast math kernels. A build with -DFAST_MATH uses them in place of libm in
+// the renderer; --selftest measures them against libm in every build.
+
+// 1 / sqrt(x) from the hardware estimate and one Newton step. Relative
+// error below 3e-7 for normal x > 0, against about 1e-7 for 1 / sqrtf(x).
+float RSqrt(float x) {
+#if defined(X86)
+  float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+  return y * (1.5f - .5f * x * y * y);
+#else
+  return 1 / sqrtf(x);
+#endif
+}
+
+// sin and cos of 2 pi u for u in [0, 1]. 4u is split into a quadrant and an
+// angle within pi / 4 of its axis, where the degree 9 Taylor polynomial
+// for sin is good to 2e-9 and the degree 8 one for cos to 2.5e-8, the
+// next terms (pi / 4)^11 / 11! and (pi / 4)^10 / 10!. With float
+// rounding the absolute error stays below 2e-7, while sinf(6.283185 * u)
+// is off by up to 5e-7 from the rounded angle alone.
+void SinCos2Pi(float u, float &s, float &c) {
+  float x = u * 4, q = floorf(x + .5f);
+  float a = (x - q) * 1.57079633f, a2 = a * a;
+  float sa = a * (1 + a2 * (-1.f / 6 + a2 * (1.f / 120 + a2 * (-1.f / 5040 + a2 * (1.f / 362880)))));
+  float ca = 1 + a2 * (-.5f + a2 * (1.f / 24 + a2 * (-1.f / 720 + a2 * (1.f / 40320))));
+  switch ((int)q & 3) {
+    case 0: s = sa, c = ca; break;
+    case 1: s = ca, c = -sa; break;
+    case 2: s = -sa, c = -ca; break;
+    default: s = -ca, c = sa; break;
+  }
+}
+
 struct Vec {
     float x, y, z;
 
@@ -21,14 +74,41 @@ struct Vec {
 
     // intnv square root
     Vec operator!() {
+#if defined(FAST_MATH)
+      return *this * RSqrt(*this % *this);
+#else
       return *this * (1 / sqrtf(*this % *this)
       );
+#endif
     }
 };
 
 float min(float l, float r) { return l < r ? l : r; }
 
-float randomVal() { return (float) rand() / RAND_MAX; }
+// Counter-based random numbers. Nothing is stored between calls: every value
+// is a hash of where it is used (pixel, sample, bounce and dimension), so
+// renders match bit for bit under any thread schedule.
+struct RandomKey {
+  unsigned int pixel, sample;
+};
+
+// "lowbias32" integer finalizer by Chris Wellons.
+unsigned int hash32(unsigned int x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+// Bounce 0 is the camera jitter, bounces 1..n are the ones in Trace().
+float randomVal(RandomKey key, int bounce, int dimension) {
+  unsigned int h = hash32(key.pixel);
+  h = hash32(h ^ key.sample);
+  h = hash32(h ^ (bounce << 16 | dimension));
+  return (h >> 8) * (1.f / 16777216); // 24 bits fill the float mantissa.
+}
 
 // Rectangle CSG equation. Returns minimum signed distance from
 // space carved by
@@ -48,8 +128,648 @@ float BoxTest(Vec position, Vec lowerLeft, Vec upperRight) {
 #define HIT_WALL 2
 #define HIT_SUN 3
 
+// Letter segment in the z = 0 plane: begin point and begin-to-end vector.
+struct Segment {
+  float beginX, beginY, edgeX, edgeY, invLengthSq;
+};
+
+// Axis-aligned bounds in the z = 0 plane.
+struct Bounds {
+  float minX = 1e9, minY = 1e9, maxX = -1e9, maxY = -1e9;
+
+  void add(float x, float y) {
+    minX = fminf(minX, x), minY = fminf(minY, y);
+    maxX = fmaxf(maxX, x), maxY = fmaxf(maxY, y);
+  }
+
+  // Squared distance from (x, y) to the bounds, 0 inside.
+  float distanceSq(float x, float y) {
+    float dx = fmaxf(fmaxf(minX - x, x - maxX), 0);
+    float dy = fmaxf(fmaxf(minY - y, y - maxY), 0);
+    return dx * dx + dy * dy;
+  }
+};
+
+// A glyph is a run of segments and, for P and R, a curve: the right half of
+// a radius 2 ring around (curveX, curveY).
+struct Glyph {
+  Bounds bounds;
+  int first, count;
+  bool curved;
+  float curveX, curveY;
+};
+
+struct Scene {
+  Segment segments[15];
+  Glyph glyphs[5];
+  Bounds bounds; // Of all glyphs.
+};
+
+Scene scene;
+
+// Decodes the letters into segments grouped per glyph, once at startup.
+void CompileScene() {
+  const char* letters =                // 15 two points lines
+          "5O5_" "5W9W" "5_9_"         // P (without curve)
+          "AOEO" "COC_" "A_E_"         // I
+          "IOQ_" "I_QO"                // X
+          "UOY_" "Y_]O" "WW[W"         // A
+          "aOa_" "aWeW" "a_e_" "cWiO"; // R (without curve)
+  int counts[5] = {3, 3, 2, 3, 4};
+  float curves[5] = {-11, 0, 0, 0, 11}; // Curve centers are at y = 6.
+
+  int first = 0;
+  scene.bounds = Bounds();
+  for (int g = 0; g < 5; ++g) {
+    Glyph &glyph = scene.glyphs[g];
+    glyph.bounds = Bounds();
+    glyph.first = first;
+    glyph.count = counts[g];
+    for (int i = first; i < first + counts[g]; ++i) {
+      const char* l = letters + 4 * i;
+      Segment &s = scene.segments[i];
+      s.beginX = (l[0] - 79) * .5f, s.beginY = (l[1] - 79) * .5f;
+      s.edgeX = (l[2] - 79) * .5f - s.beginX, s.edgeY = (l[3] - 79) * .5f - s.beginY;
+      s.invLengthSq = 1 / (s.edgeX * s.edgeX + s.edgeY * s.edgeY);
+      glyph.bounds.add(s.beginX, s.beginY);
+      glyph.bounds.add(s.beginX + s.edgeX, s.beginY + s.edgeY);
+    }
+    first += counts[g];
+
+    glyph.curved = curves[g] != 0;
+    glyph.curveX = curves[g], glyph.curveY = 6;
+    if (glyph.curved) {
+      glyph.bounds.add(glyph.curveX, glyph.curveY - 2);
+      glyph.bounds.add(glyph.curveX + 2, glyph.curveY + 2);
+    }
+
+    // Pad so rounding never puts the bounds farther away than their contents.
+    glyph.bounds.minX -= 1e-3, glyph.bounds.minY -= 1e-3;
+    glyph.bounds.maxX += 1e-3, glyph.bounds.maxY += 1e-3;
+    scene.bounds.add(glyph.bounds.minX, glyph.bounds.minY);
+    scene.bounds.add(glyph.bounds.maxX, glyph.bounds.maxY);
+  }
+}
+
+// Lowers best, a squared flat distance, to the glyph's if that is closer.
+float GlyphDistanceSq(Glyph &glyph, float x, float y, float best) {
+  for (int i = glyph.first; i < glyph.first + glyph.count; ++i) {
+    Segment &s = scene.segments[i];
+    float bx = x - s.beginX, by = y - s.beginY;
+    float t = min(fmaxf((bx * s.edgeX + by * s.edgeY) * s.invLengthSq, 0), 1);
+    float ox = bx - t * s.edgeX, oy = by - t * s.edgeY;
+    best = min(best, ox * ox + oy * oy);
+  }
+  if (glyph.curved) {
+    float ox = x - glyph.curveX, oy = y - glyph.curveY;
+    float d = ox > 0 ? fabsf(sqrtf(ox * ox + oy * oy) - 2)
+                     : (oy += oy > 0 ? -2 : 2, sqrtf(ox * ox + oy * oy));
+    best = min(best, d * d);
+  }
+  return best;
+}
+
+// fmodf(fabsf(x), 8) without the division loop. Exact: x / 8 and the
+// product are exact in float, and the difference is a multiple of x's ulp
+// below 8.
+float Plank(float x) {
+  float ax = fabsf(x);
+  return ax - truncf(ax * .125f) * 8;
+}
+
+// pow(flat^8 + z^8, 1/8) for flatSq = flat^2, with multiplications and
+// three square roots instead of three powf calls. Relative error below 3e-7.
+float Blend8(float flatSq, float z) {
+  float f4 = flatSq * flatSq, z2 = z * z, z4 = z2 * z2;
+  return sqrtf(sqrtf(sqrtf(f4 * f4 + z4 * z4)));
+}
+
+float RoomDistance(Vec position) {
+  return min(// min(A,B) = Union with Constructive solid geometry
+             //-min carves an empty space
+              -min(// Lower room
+                   BoxTest(position, Vec(-30, -.5, -30), Vec(30, 18, 30)),
+                   // Upper room
+                   BoxTest(position, Vec(-25, 17, -25), Vec(25, 20, 25))
+              ),
+              BoxTest( // Ceiling "planks" spaced 8 units apart.
+                Vec(Plank(position.x),
+                    position.y,
+                    position.z),
+                Vec(1.5, 18.5, -25),
+                Vec(6.5, 20, 25)
+              )
+  );
+}
+
+// Work counters for --bench: marched rays, their steps and scene distance
+// evaluations. Each thread counts into its own copy and adds it to the
+// totals with AddRayStats() once its tiles are done.
+struct RayStats {
+  long long rays = 0, steps = 0, queries = 0;
+};
+
+thread_local RayStats rayStats;
+RayStats rayTotals;
+std::mutex rayTotalsLock;
+
+void AddRayStats() {
+  std::lock_guard<std::mutex> lock(rayTotalsLock);
+  rayTotals.rays += rayStats.rays;
+  rayTotals.steps += rayStats.steps;
+  rayTotals.queries += rayStats.queries;
+  rayStats = RayStats();
+}
+
+// Per-pixel instrumentation for --heatmaps, compiled in with -DINSTRUMENT.
+// In other builds the INSTRUMENTED() statements are gone and cost nothing.
+#if defined(INSTRUMENT)
+#define INSTRUMENTED(statement) statement
+
+struct PixelCost {
+  long long samples = 0, steps = 0, queries = 0, bounces = 0, shadowRays = 0;
+  long long hits[4] = {0, 0, 0, 0}; // Bounces ending on each HIT_* type.
+};
+
+std::vector<PixelCost> pixelCosts; // One per pixel while --heatmaps is on.
+thread_local PixelCost pixelCost;  // What Trace() counted for this pixel.
+
+// Charges the work done during its lifetime to one pixel. Steps and
+// queries come from the difference in rayStats.
+struct PixelCostScope {
+  int index;
+  RayStats start;
+
+  PixelCostScope(int index) : index(index), start(rayStats) { pixelCost = PixelCost(); }
+
+  ~PixelCostScope() {
+    if (pixelCosts.empty()) return;
+    PixelCost &cost = pixelCosts[index];
+    cost.samples += pixelCost.samples;
+    cost.steps += rayStats.steps - start.steps;
+    cost.queries += rayStats.queries - start.queries;
+    cost.bounces += pixelCost.bounces;
+    cost.shadowRays += pixelCost.shadowRays;
+    for (int i = 0; i < 4; ++i) cost.hits[i] += pixelCost.hits[i];
+  }
+};
+#else
+#define INSTRUMENTED(statement)
+#endif
+
+// Scene files. A scene is a list of objects, each a material, which is the
+// hit type, around one distance expression, in s-expressions:
+//
+//   (wall (union (invert (box -30 -.5 -30 30 18 30)) (above-y 17)))
+//   (letter (extrude .5 (union (segment -2 0 2 0) (arc 0 4 2))))
+//
+// Solids: (box x0 y0 z0 x1 y1 z1) and (above-y y), the half space above y.
+// CSG: (union a b ...), (intersect a b ...), (subtract a b) and (invert a).
+// Domains: (translate x y z a), and (repeat-x period a), which folds |x|
+// into [0, period). (extrude r shape) rounds a flat shape in the z = 0
+// plane into a solid of radius r, with the pow-8 blend of the letters.
+// Shapes are unions of (segment x0 y0 x1 y1), (arc x y r), which is the
+// right half of a ring and the P and R curves, and (ring x y r). Every
+// direct child of the outermost union of a shape is culled by its bounds.
+// ; starts a comment. Expressions nest at most SCENE_NESTING deep, and at
+// most SCENE_STACK distances or repeat-x domains may be pending at once.
+//
+// LoadScene() compiles the objects into a flat instruction stream for a
+// stack machine. Translations and segment edges are folded into the
+// constants and bounds are computed, so RunScene() only does the
+// evaluation. Objects are tried in order and a later one wins ties. An
+// extrusion that is a whole object skips its flat shape when it cannot
+// beat the objects before it, so letters go last.
+enum {
+  OP_BOX, OP_ABOVE_Y, OP_UNION, OP_INTERSECT, OP_SUBTRACT, OP_INVERT,
+  OP_REPEAT_X, OP_POP_DOMAIN, OP_FLAT, OP_GROUP, OP_SEGMENT, OP_ARC, OP_RING,
+  OP_EXTRUDE, OP_MATERIAL
+};
+
+struct Instruction {
+  int op, count; // count: instructions a culled OP_FLAT or OP_GROUP skips, or a hit type.
+  float k[6];
+};
+
+#define SCENE_STACK 16   // Distances and folded domains RunScene() holds.
+#define SCENE_NESTING 64 // Parenthesis depth the parser and compiler recurse to.
+
+struct SceneNode {
+  std::string name;
+  std::vector<float> numbers;
+  std::vector<SceneNode> children;
+  int line;
+};
+
+// Moves at past whitespace and comments, counting lines.
+void SkipSceneSpace(const std::string &text, size_t &at, int &line) {
+  while (at < text.size() && (isspace(text[at]) || text[at] == ';')) {
+    if (text[at] == ';') while (at < text.size() && text[at] != '\n') ++at;
+    else line += text[at++] == '\n';
+  }
+}
+
+// Reads one s-expression starting at text[at], which is past whitespace.
+bool ParseSceneNode(const std::string &text, size_t &at, int &line, SceneNode &node,
+                    std::string &error, int nesting = 0) {
+  node.line = line;
+  if (nesting >= SCENE_NESTING) return error = "nested too deeply", false;
+  if (text[at++] != '(') return error = "expected (", false;
+  for (;;) {
+    SkipSceneSpace(text, at, line);
+    if (at >= text.size()) return error = "missing )", false;
+    if (text[at] == ')') return ++at, !node.name.empty() || (error = "empty ()", false);
+    if (text[at] == '(') {
+      node.children.emplace_back();
+      if (!ParseSceneNode(text, at, line, node.children.back(), error, nesting + 1)) return false;
+      continue;
+    }
+    size_t start = at;
+    while (at < text.size() && !isspace(text[at]) && text[at] != '(' && text[at] != ')'
+           && text[at] != ';')
+      ++at;
+    std::string atom = text.substr(start, at - start);
+    char* end;
+    float number = strtof(atom.c_str(), &end);
+    if (node.name.empty()) node.name = atom;
+    else if (*end) return error = "expected a number, got " + atom, false;
+    else node.numbers.push_back(number);
+  }
+}
+
+struct SceneCompiler {
+  std::vector<Instruction> program;
+  std::string error;
+  int line, depth = 0, maxDepth = 0, domains = 0, maxDomains = 0;
+
+  void emit(int op, int stackChange, std::initializer_list<float> k, int count = 0) {
+    Instruction instruction = {op, count, {}};
+    std::copy(k.begin(), k.end(), instruction.k);
+    program.push_back(instruction);
+    depth += stackChange;
+    if (depth > maxDepth) maxDepth = depth;
+    domains += (op == OP_REPEAT_X) - (op == OP_POP_DOMAIN);
+    if (domains > maxDomains) maxDomains = domains;
+  }
+
+  bool fail(SceneNode &node, std::string message) {
+    if (error.empty()) error = message, line = node.line;
+    return false;
+  }
+
+  bool expect(SceneNode &node, size_t numbers, size_t children) {
+    if (node.numbers.size() == numbers && node.children.size() == children) return true;
+    return fail(node, node.name + " takes " + std::to_string(numbers) + " numbers and "
+                      + std::to_string(children) + " operands");
+  }
+
+  void bound(Instruction &head, Bounds &bounds, int count) {
+    // Padded so rounding never puts the bounds inside their contents.
+    head.k[0] = bounds.minX - 1e-3f, head.k[1] = bounds.minY - 1e-3f;
+    head.k[2] = bounds.maxX + 1e-3f, head.k[3] = bounds.maxY + 1e-3f;
+    head.count = count;
+  }
+
+  // A flat primitive, shifted by offset, growing bounds.
+  bool shape(SceneNode &node, Vec offset, Bounds &bounds) {
+    std::vector<float> &n = node.numbers;
+    if (node.name == "union") {
+      if (node.children.empty() || !node.numbers.empty()) return fail(node, "bad union");
+      for (SceneNode &child : node.children)
+        if (!shape(child, offset, bounds)) return false;
+    } else if (node.name == "segment") {
+      if (!expect(node, 4, 0)) return false;
+      float x = n[0] + offset.x, y = n[1] + offset.y, ex = n[2] - n[0], ey = n[3] - n[1];
+      if (ex == 0 && ey == 0) return fail(node, "segment of length 0");
+      emit(OP_SEGMENT, 0, {x, y, ex, ey, 1 / (ex * ex + ey * ey)});
+      bounds.add(x, y), bounds.add(x + ex, y + ey);
+    } else if (node.name == "arc" || node.name == "ring") {
+      if (!expect(node, 3, 0)) return false;
+      float x = n[0] + offset.x, y = n[1] + offset.y, r = n[2];
+      emit(node.name == "arc" ? OP_ARC : OP_RING, 0, {x, y, r});
+      bounds.add(node.name == "arc" ? x : x - r, y - r), bounds.add(x + r, y + r);
+    } else {
+      return fail(node, "unknown shape " + node.name);
+    }
+    return true;
+  }
+
+  bool solid(SceneNode &node, Vec offset, bool wholeObject) {
+    std::vector<float> &n = node.numbers;
+    std::string &name = node.name;
+    if (name == "box") {
+      if (!expect(node, 6, 0)) return false;
+      emit(OP_BOX, 1, {n[0] + offset.x, n[1] + offset.y, n[2] + offset.z,
+                       n[3] + offset.x, n[4] + offset.y, n[5] + offset.z});
+    } else if (name == "above-y") {
+      if (!expect(node, 1, 0)) return false;
+      emit(OP_ABOVE_Y, 1, {n[0] + offset.y});
+    } else if (name == "union" || name == "intersect") {
+      if (node.children.empty() || !n.empty()) return fail(node, "bad " + name);
+      for (size_t i = 0; i < node.children.size(); ++i) {
+        if (!solid(node.children[i], offset, false)) return false;
+        if (i) emit(name == "union" ? OP_UNION : OP_INTERSECT, -1, {});
+      }
+    } else if (name == "subtract") {
+      if (!expect(node, 0, 2) || !solid(node.children[0], offset, false)
+          || !solid(node.children[1], offset, false))
+        return false;
+      emit(OP_SUBTRACT, -1, {});
+    } else if (name == "invert") {
+      if (!expect(node, 0, 1)) return false;
+      SceneNode &child = node.children[0];
+      if (child.name == "invert" && child.children.size() == 1)
+        return solid(child.children[0], offset, wholeObject); // Folded away.
+      if (!solid(child, offset, false)) return false;
+      emit(OP_INVERT, 0, {});
+    } else if (name == "translate") {
+      if (!expect(node, 3, 1)) return false;
+      return solid(node.children[0], offset + Vec(n[0], n[1], n[2]), wholeObject);
+    } else if (name == "repeat-x") {
+      if (!expect(node, 1, 1)) return false;
+      if (!(n[0] > 0)) return fail(node, "repeat-x needs a positive period");
+      // The x offset is applied before folding; y and z pass through.
+      emit(OP_REPEAT_X, 0, {n[0], 1 / n[0], offset.x});
+      if (!solid(node.children[0], Vec(0, offset.y, offset.z), wholeObject)) return false;
+      emit(OP_POP_DOMAIN, 0, {});
+    } else if (name == "extrude") {
+      if (!expect(node, 1, 1)) return false;
+      // One group per direct child of the outermost union.
+      SceneNode &shapes = node.children[0];
+      std::vector<SceneNode> single(1, shapes);
+      std::vector<SceneNode> &groups = shapes.name == "union" ? shapes.children : single;
+      size_t flat = program.size();
+      Bounds all;
+      emit(OP_FLAT, 0, {});
+      for (SceneNode &group : groups) {
+        size_t start = program.size();
+        Bounds bounds;
+        emit(OP_GROUP, 0, {});
+        if (!shape(group, offset, bounds)) return false;
+        bound(program[start], bounds, program.size() - start - 1);
+        all.add(bounds.minX, bounds.minY), all.add(bounds.maxX, bounds.maxY);
+      }
+      bound(program[flat], all, program.size() - flat - 1);
+      program[flat].k[4] = wholeObject ? n[0] + .001f : 1e9f;
+      emit(OP_EXTRUDE, 1, {n[0], offset.z});
+    } else {
+      return fail(node, "unknown solid " + name);
+    }
+    return true;
+  }
+
+  bool object(SceneNode &node) {
+    int type = node.name == "wall" ? HIT_WALL : node.name == "letter" ? HIT_LETTER
+               : node.name == "sun" ? HIT_SUN : HIT_NONE;
+    if (type == HIT_NONE) return fail(node, "unknown material " + node.name);
+    if (!expect(node, 0, 1) || !solid(node.children[0], Vec(), true)) return false;
+    emit(OP_MATERIAL, -1, {}, type);
+    return true;
+  }
+};
+
+// The scene program RunScene() evaluates, empty for the built-in
+// QueryDatabase().
+std::vector<Instruction> sceneProgram;
+
+// Compiles scene text into program, or prints where it went wrong. With
+// error, the message goes there instead.
+bool CompileSceneText(const std::string &text, const char* name, std::vector<Instruction> &program,
+                      std::string* error = NULL) {
+  SceneCompiler compiler;
+  char where[32] = "";
+  int line = 1;
+  for (size_t at = 0; compiler.error.empty();) {
+    SkipSceneSpace(text, at, line);
+    if (at >= text.size()) break;
+    SceneNode node;
+    bool parsed = ParseSceneNode(text, at, line, node, compiler.error);
+    if (!parsed || !compiler.object(node))
+      snprintf(where, sizeof(where), ":%d", parsed ? compiler.line : line);
+  }
+  if (compiler.error.empty() && compiler.program.empty()) compiler.error = "no objects";
+  else if (compiler.error.empty()
+           && (compiler.maxDepth > SCENE_STACK || compiler.maxDomains > SCENE_STACK))
+    compiler.error = "nested too deeply";
+  if (compiler.error.empty()) return program = compiler.program, true;
+  if (error) *error = compiler.error;
+  else fprintf(stderr, "%s%s: %s\n", name, where, compiler.error.c_str());
+  return false;
+}
+
+bool LoadScene(const char* name) {
+  FILE* file = fopen(name, "rb");
+  if (!file) return fprintf(stderr, "cannot read %s\n", name), false;
+  std::string text;
+  char buffer[4096];
+  for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file));) text.append(buffer, n);
+  fclose(file);
+  return CompileSceneText(text, name, sceneProgram);
+}
+
+// The built-in card in the scene format. QueryDatabase() is the hand-written
+// specialization of it; --interpret runs it through RunScene() instead.
+const char* builtinScene =
+    "; Everything above 19.9 is light source.\n"
+    "(sun (above-y 19.9))\n"
+    "; Two boxes carved out of space, with ceiling planks every 8 units.\n"
+    "(wall (union (invert (union (box -30 -.5 -30 30 18 30)\n"
+    "                            (box -25 17 -25 25 20 25)))\n"
+    "             (repeat-x 8 (box 1.5 18.5 -25 6.5 20 25))))\n"
+    "(letter (extrude .5 (union\n"
+    "  (union (segment -13 0 -13 8) (segment -13 4 -11 4) (segment -13 8 -11 8)\n"
+    "         (arc -11 6 2))                                                  ; P\n"
+    "  (union (segment -7 0 -5 0) (segment -6 0 -6 8) (segment -7 8 -5 8))   ; I\n"
+    "  (union (segment -3 0 1 8) (segment -3 8 1 0))                          ; X\n"
+    "  (union (segment 3 0 5 8) (segment 5 8 7 0) (segment 4 4 6 4))         ; A\n"
+    "  (union (segment 9 0 9 8) (segment 9 4 11 4) (segment 9 8 11 8)\n"
+    "         (segment 10 4 13 0) (arc 11 6 2)))))                            ; R\n";
+
+// Evaluates a scene program at position: a switch over the instructions,
+// with the distances on a small stack and the folded domains on another.
+float RunScene(const std::vector<Instruction> &program, Vec position, int &hitType) {
+  float stack[SCENE_STACK], distance = 1e9, flat = 0, cutoffSq = 0;
+  Vec domains[SCENE_STACK];
+  int top = 0, domain = 0;
+  hitType = HIT_NONE;
+  const Instruction* end = program.data() + program.size();
+  for (const Instruction* i = program.data(); i < end; ++i) {
+    const float* k = i->k;
+    switch (i->op) {
+      case OP_BOX:
+        stack[top++] = BoxTest(position, Vec(k[0], k[1], k[2]), Vec(k[3], k[4], k[5]));
+        break;
+      case OP_ABOVE_Y: stack[top++] = k[0] - position.y; break;
+      case OP_UNION: --top, stack[top - 1] = min(stack[top - 1], stack[top]); break;
+      case OP_INTERSECT: --top, stack[top - 1] = fmaxf(stack[top - 1], stack[top]); break;
+      case OP_SUBTRACT: --top, stack[top - 1] = fmaxf(stack[top - 1], -stack[top]); break;
+      case OP_INVERT: stack[top - 1] = -stack[top - 1]; break;
+      case OP_REPEAT_X: {
+        domains[domain++] = position;
+        float ax = fabsf(position.x - k[2]);
+        position.x = ax - truncf(ax * k[1]) * k[0]; // Exact for powers of two, like Plank().
+        break;
+      }
+      case OP_POP_DOMAIN: position = domains[--domain]; break;
+      case OP_FLAT: {
+        float cutoff = distance + k[4];
+        flat = cutoffSq = cutoff * cutoff;
+      } // Fall through: the whole shape is culled by its bounds first.
+      case OP_GROUP: {
+        float dx = fmaxf(fmaxf(k[0] - position.x, position.x - k[2]), 0);
+        float dy = fmaxf(fmaxf(k[1] - position.y, position.y - k[3]), 0);
+        if (!(dx * dx + dy * dy < flat)) i += i->count;
+        break;
+      }
+      case OP_SEGMENT: {
+        float bx = position.x - k[0], by = position.y - k[1];
+        float t = min(fmaxf((bx * k[2] + by * k[3]) * k[4], 0), 1);
+        float ox = bx - t * k[2], oy = by - t * k[3];
+        flat = min(flat, ox * ox + oy * oy);
+        break;
+      }
+      case OP_ARC: {
+        float ox = position.x - k[0], oy = position.y - k[1];
+        float d = ox > 0 ? fabsf(sqrtf(ox * ox + oy * oy) - k[2])
+                         : (oy += oy > 0 ? -k[2] : k[2], sqrtf(ox * ox + oy * oy));
+        flat = min(flat, d * d);
+        break;
+      }
+      case OP_RING: {
+        float ox = position.x - k[0], oy = position.y - k[1];
+        float d = fabsf(sqrtf(ox * ox + oy * oy) - k[2]);
+        flat = min(flat, d * d);
+        break;
+      }
+      case OP_EXTRUDE:
+        stack[top++] = flat >= cutoffSq ? 1e9f : Blend8(flat, position.z - k[1]) - k[0];
+        break;
+      case OP_MATERIAL:
+        if (stack[--top] <= distance) distance = stack[top], hitType = i->count;
+        break;
+    }
+  }
+  return distance;
+}
+
 // Sample the world using Signed Distance Fields.
 float QueryDatabase(Vec position, int &hitType) {
+  ++rayStats.queries;
+  if (!sceneProgram.empty()) return RunScene(sceneProgram, position, hitType);
+  float distance = RoomDistance(position);
+  hitType = HIT_WALL;
+
+  float sun = 19.9 - position.y ; // Everything above 19.9 is light source.
+  if (sun < distance) distance = sun, hitType = HIT_SUN;
+
+  // The pow-8 blend never goes below the flat distance, so a glyph whose
+  // bounds are farther than distance + .5 cannot beat the room or the sun.
+  // Most march steps are far from the text and skip every glyph.
+  float cutoff = distance + .501f, best = cutoff * cutoff;
+  if (scene.bounds.distanceSq(position.x, position.y) >= best) return distance;
+  for (int g = 0; g < 5; ++g) {
+    Glyph &glyph = scene.glyphs[g];
+    if (glyph.bounds.distanceSq(position.x, position.y) < best)
+      best = GlyphDistanceSq(glyph, position.x, position.y, best);
+  }
+  if (best >= cutoff * cutoff) return distance;
+
+  float letter = Blend8(best, position.z) - .5;
+  if (letter <= distance) distance = letter, hitType = HIT_LETTER; // Letters win ties.
+  return distance;
+}
+
+// The same box with the gradient of the distance: the normal of whichever
+// face the -min picks.
+float BoxTest(Vec position, Vec lowerLeft, Vec upperRight, Vec &gradient) {
+  float faces[6] = {position.x - lowerLeft.x, upperRight.x - position.x,
+                    position.y - lowerLeft.y, upperRight.y - position.y,
+                    position.z - lowerLeft.z, upperRight.z - position.z};
+  int k = 0;
+  for (int i = 1; i < 6; ++i) if (faces[i] < faces[k]) k = i;
+  float s = k % 2 ? 1 : -1;
+  gradient = Vec(k / 2 == 0 ? s : 0, k / 2 == 1 ? s : 0, k / 2 == 2 ? s : 0);
+  return -faces[k];
+}
+
+float RoomDistance(Vec position, Vec &gradient) {
+  Vec lower, upper, plank;
+  float lowerRoom = BoxTest(position, Vec(-30, -.5, -30), Vec(30, 18, 30), lower);
+  float upperRoom = BoxTest(position, Vec(-25, 17, -25), Vec(25, 20, 25), upper);
+  float room = -min(lowerRoom, upperRoom);
+  gradient = (lowerRoom < upperRoom ? lower : upper) * -1;
+  float planks = BoxTest(Vec(Plank(position.x), position.y, position.z),
+                         Vec(1.5, 18.5, -25), Vec(6.5, 20, 25), plank);
+  if (planks < room) {
+    // d/dx fmodf(|x|, 8) is the sign of x.
+    gradient = Vec(position.x < 0 ? -plank.x : plank.x, plank.y, plank.z);
+    return planks;
+  }
+  return room;
+}
+
+// GlyphDistanceSq() that also keeps the flat offset from the closest point of
+// the closest primitive so far; its direction is the flat gradient.
+float GlyphDistanceSq(Glyph &glyph, float x, float y, float best, float &offsetX, float &offsetY) {
+  for (int i = glyph.first; i < glyph.first + glyph.count; ++i) {
+    Segment &s = scene.segments[i];
+    float bx = x - s.beginX, by = y - s.beginY;
+    float t = min(fmaxf((bx * s.edgeX + by * s.edgeY) * s.invLengthSq, 0), 1);
+    float ox = bx - t * s.edgeX, oy = by - t * s.edgeY;
+    if (ox * ox + oy * oy < best) best = ox * ox + oy * oy, offsetX = ox, offsetY = oy;
+  }
+  if (glyph.curved) {
+    float ox = x - glyph.curveX, oy = y - glyph.curveY, r = sqrtf(ox * ox + oy * oy);
+    if (ox > 0) {
+      // Ring: the offset runs along the radius, away from the ring line.
+      float d = fabsf(r - 2);
+      if (d * d < best) best = d * d, offsetX = ox * (r - 2) / r, offsetY = oy * (r - 2) / r;
+    } else {
+      oy += oy > 0 ? -2 : 2; // End caps.
+      if (ox * ox + oy * oy < best) best = ox * ox + oy * oy, offsetX = ox, offsetY = oy;
+    }
+  }
+  return best;
+}
+
+// QueryDatabase() that also returns the gradient of the distance, from the
+// analytic derivative of the closest primitive. One call replaces the three
+// extra queries of a finite-difference normal.
+float QueryDatabase(Vec position, int &hitType, Vec &gradient) {
+  ++rayStats.queries;
+  float distance = RoomDistance(position, gradient);
+  hitType = HIT_WALL;
+
+  float sun = 19.9 - position.y ;
+  if (sun < distance) distance = sun, hitType = HIT_SUN, gradient = Vec(0, -1, 0);
+
+  float cutoff = distance + .501f, best = cutoff * cutoff, offsetX = 0, offsetY = 0;
+  if (scene.bounds.distanceSq(position.x, position.y) >= best) return distance;
+  for (int g = 0; g < 5; ++g) {
+    Glyph &glyph = scene.glyphs[g];
+    if (glyph.bounds.distanceSq(position.x, position.y) < best)
+      best = GlyphDistanceSq(glyph, position.x, position.y, best, offsetX, offsetY);
+  }
+  if (best >= cutoff * cutoff) return distance;
+
+  float flat = sqrtf(best);
+  float blend = Blend8(best, position.z);
+  float letter = blend - .5;
+  if (letter <= distance) {
+    // d/dflat = (flat/blend)^7 and d/dz = (z/blend)^7, with the flat
+    // gradient being offset / flat.
+    float u = flat / blend, v = position.z / blend;
+    float u6 = u * u * u * u * u * u;
+    gradient = Vec(offsetX * u6 / blend, offsetY * u6 / blend, v * v * v * v * v * v * v);
+    distance = letter, hitType = HIT_LETTER;
+  }
+  return distance;
+}
+
+// The original SDF, decoding the letters on every call and evaluating every
+// primitive. Kept as the reference that --selftest checks QueryDatabase()
+// against.
+float QueryDatabaseReference(Vec position, int &hitType) {
   float distance = 1e9;
   Vec f = position; // Flattened position (z=0)
   f.z = 0;
@@ -60,7 +780,7 @@ float QueryDatabase(Vec position, int &hitType) {
           "UOY_" "Y_]O" "WW[W"         // A
           "aOa_" "aWeW" "a_e_" "cWiO"; // R (without curve)
 
-  for (int i = 0; i < sizeof(letters); i += 4) {
+  for (int i = 0; i < 15*4; i += 4) { // Stop before the terminating '\0'.
     Vec begin = Vec(letters[i] - 79, letters[i + 1] - 79) * .5;
     Vec e = Vec(letters[i + 2] - 79, letters[i + 3] - 79) * .5 + begin * -1;
     Vec o = f + (begin + e * min(-min((begin + f * -1) % e / (e % e),
@@ -107,168 +827,2450 @@ float QueryDatabase(Vec position, int &hitType) {
   return distance;
 }
 
+// Normals from three forward differences instead of the analytic gradient.
+// Scene programs have no gradients and always take differences.
+bool finiteDifferenceNormals = false;
+
+Vec HitNormal(Vec hitPos, float d) {
+  int hitType;
+  Vec gradient;
+  if (!finiteDifferenceNormals && sceneProgram.empty())
+    return QueryDatabase(hitPos, hitType, gradient), !gradient;
+  return !Vec(QueryDatabase(hitPos + Vec(.01, 0), hitType) - d,
+              QueryDatabase(hitPos + Vec(0, .01), hitType) - d,
+              QueryDatabase(hitPos + Vec(0, 0, .01), hitType) - d);
+}
+
+// Marching strategies. MARCH_RELAXED is over-relaxed sphere tracing with a
+// safe fallback (Keinert et al., "Enhanced Sphere Tracing"). On primary
+// rays its hit epsilon also grows with a tenth of the pixel footprint along
+// the ray: a whole footprint fattens the ceiling planks enough to darken
+// the frame by over 1%. Bounces and shadow rays start at a surface and keep
+// the fixed .01.
+#define MARCH_CLASSIC 0
+#define MARCH_RELAXED 1
+
+int marchStrategy = MARCH_CLASSIC;
+float pixelFootprint = 0; // Camera::footprint of the frame being rendered.
+
+// Every RayMarching() call ends here. When set, its step count also goes
+// into this histogram.
+#define MAX_HISTOGRAM_STEPS 256
+thread_local long long* stepHistogram = NULL;
+
+void RecordSteps(int steps) {
+  ++rayStats.rays, rayStats.steps += steps;
+  if (stepHistogram) ++stepHistogram[steps < MAX_HISTOGRAM_STEPS ? steps : MAX_HISTOGRAM_STEPS - 1];
+}
+
+// Per-thread counters of how the brick map answered the marchers.
+struct BrickStats {
+  long long skipped = 0, exact = 0;
+};
+
+thread_local BrickStats brickStats;
+
+// Optional map of empty space over the room volume (-30..30 x -.5..20.5 x
+// -30..30), split into cubic bricks that each store one conservative bound:
+// the distance at the brick's center less half its diagonal. The SDF is
+// 1-Lipschitz, so where the bound is positive, nothing lies within it of
+// any point of the brick, and a ray can leave the brick and go on by the
+// bound for one lookup instead of several QueryDatabase() calls. A march
+// only looks a point up after a step of at least a brick: near surfaces
+// the bricks are not empty, and the lookup would be wasted. The classic
+// marcher uses the map; the relaxed one would need an exact distance at
+// every point to check its overlapping spheres.
+//
+// At 160x90 with 16 spp on one thread, 256 KB (bricks of 1.05) renders in
+// 1.38 s against 1.57 s without the map. 4 MB of finer bricks takes longer
+// steps but misses the cache, at 1.63 s.
+struct BrickMap {
+  Vec origin = Vec(-30, -.5, -30);
+  float brickSize, scale;
+  int bricksX, bricksY, bricksZ;
+  std::vector<float> bounds;
+  BrickStats totals;
+  std::mutex totalsLock;
+
+  // Bricks as fine as budget bytes allow, but no finer than .25.
+  void build(size_t budget) {
+    brickSize = fmaxf(.25f, cbrtf(60 * 21 * 60 * sizeof(float) / (float)budget));
+    scale = 1 / brickSize;
+    bricksX = ceilf(60 * scale), bricksY = ceilf(21 * scale), bricksZ = ceilf(60 * scale);
+    bounds.assign(bricksX * bricksY * bricksZ, 0);
+    int hitType;
+    for (int bz = 0; bz < bricksZ; ++bz)
+      for (int by = 0; by < bricksY; ++by)
+        for (int bx = 0; bx < bricksX; ++bx) {
+          Vec center = origin + Vec(bx + .5, by + .5, bz + .5) * brickSize;
+          // Half the diagonal, rounded up, and a margin for rounding.
+          bounds[(bz * bricksY + by) * bricksX + bx] =
+              QueryDatabase(center, hitType) - brickSize * .8661f - 1e-3f;
+        }
+  }
+
+  bool on() { return !bounds.empty(); }
+
+  // The bound of the brick holding position, or 0 outside the map.
+  float bound(Vec position) {
+    Vec local = (position + origin * -1) * scale;
+    int bx = floorf(local.x), by = floorf(local.y), bz = floorf(local.z);
+    if (bx < 0 || by < 0 || bz < 0 || bx >= bricksX || by >= bricksY || bz >= bricksZ) return 0;
+    return bounds[(bz * bricksY + by) * bricksX + bx];
+  }
+
+  // A safe step from position along direction, past the end of its brick,
+  // or 0 when the exact SDF has to be evaluated. inverse holds brickSize
+  // over the absolute components of direction.
+  float step(Vec position, Vec direction, Vec inverse) {
+    float safe = bound(position);
+    if (safe <= 0) return ++brickStats.exact, 0;
+    ++brickStats.skipped;
+    Vec local = (position + origin * -1) * scale;
+    float bx = floorf(local.x), by = floorf(local.y), bz = floorf(local.z);
+    float exitX = (direction.x > 0 ? bx + 1 - local.x : local.x - bx) * inverse.x;
+    float exitY = (direction.y > 0 ? by + 1 - local.y : local.y - by) * inverse.y;
+    float exitZ = (direction.z > 0 ? bz + 1 - local.z : local.z - bz) * inverse.z;
+    return fminf(exitX, fminf(exitY, exitZ)) + safe;
+  }
+
+  Vec inverse(Vec direction) {
+    return Vec(brickSize / fabsf(direction.x), brickSize / fabsf(direction.y),
+               brickSize / fabsf(direction.z));
+  }
+
+  void addStats(BrickStats &stats) {
+    std::lock_guard<std::mutex> lock(totalsLock);
+    totals.skipped += stats.skipped, totals.exact += stats.exact;
+    stats = BrickStats();
+  }
+};
+
+BrickMap brickMap;
+
+int RayMarchingRelaxed(Vec origin, Vec direction, Vec &hitPos, Vec &hitNorm, float footprint) {
+  int hitType = HIT_NONE;
+  int noHitCount = 0, steps = 0;
+  float omega = 1.6; // Step scale, dropped to 1 after the first failed step.
+  float previousRadius = 0, stepLength = 0;
+  bool relaxed = false; // Whether the last step went past the safe radius.
+
+  for (float total_d = 0; total_d < 100; total_d += stepLength, ++steps) {
+    hitPos = origin + direction * total_d;
+    float d = QueryDatabase(hitPos, hitType);
+
+    // The spheres of the last two points must overlap, or the relaxed step
+    // may have jumped over a surface: go back inside the previous sphere and
+    // march unrelaxed from there.
+    if (relaxed && fabsf(d) + previousRadius < stepLength) {
+      stepLength -= omega * stepLength;
+      omega = 1, relaxed = false;
+      ++noHitCount;
+      continue;
+    }
+    if (d < fmaxf(.01, .1f * footprint * total_d) || ++noHitCount > 99)
+      return RecordSteps(steps + 1), hitNorm = HitNormal(hitPos, d), hitType;
+    previousRadius = d;
+    stepLength = d * omega;
+    relaxed = omega > 1;
+  }
+  RecordSteps(steps);
+  return 0;
+}
+
 // Perform signed sphere marching
 // Returns hitType 0, 1, 2, or 3 and update hit position/normal
-int RayMarching(Vec origin, Vec direction, Vec &hitPos, Vec &hitNorm) {
+// footprint: pixelFootprint for camera rays, which the relaxed marcher uses.
+int RayMarching(Vec origin, Vec direction, Vec &hitPos, Vec &hitNorm, float footprint = 0) {
+  if (marchStrategy == MARCH_RELAXED)
+    return RayMarchingRelaxed(origin, direction, hitPos, hitNorm, footprint);
+
   int hitType = HIT_NONE;
-  int noHitCount = 0;
+  int noHitCount = 0, steps = 0;
   float d; // distance from closest object in world.
 
+  // Steps over empty bricks are far from any surface and do not count as
+  // misses.
+  bool bricks = brickMap.on(), look = bricks;
+  Vec inverse = bricks ? brickMap.inverse(direction) : Vec();
+
   // Signed distance marching
-  for (float total_d=0; total_d < 100; total_d += d)
-    if ((d = QueryDatabase(hitPos = origin + direction * total_d, hitType)) < .01
+  for (float total_d=0; total_d < 100; total_d += d, ++steps)
+    if (look && (d = brickMap.step(origin + direction * total_d, direction, inverse)) > 0)
+      continue;
+    else if ((d = QueryDatabase(hitPos = origin + direction * total_d, hitType)) < .01
             || ++noHitCount > 99)
-      return hitNorm =
-         !Vec(QueryDatabase(hitPos + Vec(.01, 0), noHitCount) - d,
-              QueryDatabase(hitPos + Vec(0, .01), noHitCount) - d,
-              QueryDatabase(hitPos + Vec(0, 0, .01), noHitCount) - d)
+      return RecordSteps(steps + 1), hitNorm = HitNormal(hitPos, d)
          , hitType; // Weird return statement where a variable is also updated.
+    else
+      look = bricks && d >= brickMap.brickSize;
+  RecordSteps(steps);
   return 0;
 }
 
-Vec Trace(Vec origin, Vec direction) {
-  Vec sampledPosition, normal, color, attenuation = 1;
-  Vec lightDirection(!Vec(.6, .6, 1)); // Directional light
-
-  for (int bounceCount = 3; bounceCount--;) {
-    int hitType = RayMarching(origin, direction, sampledPosition, normal);
-    if (hitType == HIT_NONE) break; // No hit. This is over, return color.
-    if (hitType == HIT_LETTER) { // Specular bounce on a letter. No color acc.
-      direction = direction + normal * ( normal % direction * -2);
-      origin = sampledPosition + direction * 0.1;
-      attenuation = attenuation * 0.2; // Attenuation via distance traveled.
-    }
-    if (hitType == HIT_WALL) { // Wall hit uses color yellow?
-      float incidence = normal % lightDirection;
-      float p = 6.283185 * randomVal();
-      float c = randomVal();
-      float s = sqrtf(1 - c);
-      float g = normal.z < 0 ? -1 : 1;
-      float u = -1 / (g + normal.z);
-      float v = normal.x * normal.y * u;
-      direction = Vec(v,
-                      g + normal.y * normal.y * u,
-                      -normal.y) * (cosf(p) * s)
-                  +
-                  Vec(1 + g * normal.x * normal.x * u,
-                      g * v,
-                      -g * normal.x) * (sinf(p) * s) + normal * sqrtf(c);
-      origin = sampledPosition + direction * .1;
-      attenuation = attenuation * 0.2;
-      if (incidence > 0 &&
-          RayMarching(sampledPosition + normal * .1,
-                      lightDirection,
-                      sampledPosition,
-                      normal) == HIT_SUN)
-        color = color + attenuation * Vec(500, 400, 100) * incidence;
-    }
-    if (hitType == HIT_SUN) { //
-      color = color + attenuation * Vec(50, 80, 100); break; // Sun Color
-    }
-  }
-  return color;
-}
-
-void createBMP(byte data[], int w, int h, char* fName) {
-    FILE *f;
-    int filesize = 54 + 3*w*h;
-
-    byte *img = new byte[3*w*h];
-    //memset(img, 0, 3*w*h);
-
-    for(int i = 0; i < w; ++i) {
-        for(int j = 0; j < h; ++j) {
-            int indSource = (j*w + i)*3;
-            int indTarget = (w*j + w - i - 1)*3;
-
-            img[indTarget    ] = data[indSource + 2];
-            img[indTarget + 1] = data[indSource + 1];
-            img[indTarget + 2] = data[indSource    ];
-        }
+// The card's light: a directional sun, and the sky it shines from.
+Vec sunDirection = !Vec(.6, .6, 1), sunColor(500, 400, 100), skyColor(50, 80, 100);
+
+// Per-thread counters of how sun shadow rays were answered.
+struct SunMapStats {
+  long long lit = 0, shadowed = 0, marched = 0;
+};
+
+thread_local SunMapStats sunMapStats;
+
+// Optional map of where the directional sun reaches, to answer the shadow
+// rays of wall hits without marching. Sunlight only enters through the sky
+// at y = 19.9 over the upper room, so a point is lit when the ray from it
+// toward the sun reaches that plane at an open spot, and nothing lies in
+// between. The map covers the plane with a grid of corners, and marches
+// from each open one along the light into the room to store how far the
+// first surface is, or 0 where the sky is closed. A shadow ray origin is
+// projected onto the plane along the light. When it is closer than the
+// nearest surface at all four corners of its cell, by a margin, it is lit.
+// When it is farther than the farthest one, it is shadowed. Otherwise, at
+// edges and on steep surfaces, the ray is marched as before.
+struct SunMap {
+  int size = 0;  // Cells per side, 0 when the map is off.
+  float cellSize;
+  Vec light;
+  std::vector<float> depths; // (size + 1)^2 corners, x fastest.
+  SunMapStats totals;
+  std::mutex totalsLock;
+
+  void build(int cells) {
+    size = cells, cellSize = 50.f / cells;
+    light = sunDirection;
+    depths.assign((size + 1) * (size + 1), 0);
+    for (int j = 0; j <= size; ++j)
+      for (int i = 0; i <= size; ++i) {
+        Vec sky(-25 + i * cellSize, 19.9, -25 + j * cellSize), position, normal;
+        int hitType;
+        QueryDatabase(sky, hitType);
+        if (hitType != HIT_SUN) continue;
+        // Start below the sky, where the march will not stop on it at once.
+        Vec start = sky + light * -.1;
+        if (!RayMarching(start, light * -1, position, normal)) continue;
+        Vec offset = position + sky * -1;
+        depths[j * (size + 1) + i] = sqrtf(offset % offset);
+      }
+  }
+
+  // HIT_SUN or HIT_WALL when the map can tell, -1 when origin must march.
+  int lookup(Vec origin) {
+    float t = (19.9f - origin.y) / light.y;
+    Vec sky = origin + light * t;
+    float u = (sky.x + 25) / cellSize, v = (sky.z + 25) / cellSize;
+    // Past the upper room the ray runs into the ceiling.
+    if (!(u >= 0 && v >= 0 && u < size && v < size)) return ++sunMapStats.shadowed, HIT_WALL;
+    int i = u, j = v;
+    float* corner = &depths[j * (size + 1) + i];
+    float a = corner[0], b = corner[1], c = corner[size + 1], d = corner[size + 2];
+    float nearest = fminf(fminf(a, b), fminf(c, d)), farthest = fmaxf(fmaxf(a, b), fmaxf(c, d));
+    if (t < nearest - .05f) return ++sunMapStats.lit, HIT_SUN;
+    if (t > farthest + .05f) return ++sunMapStats.shadowed, HIT_WALL;
+    ++sunMapStats.marched;
+    return -1;
+  }
+
+  void addStats(SunMapStats &stats) {
+    std::lock_guard<std::mutex> lock(totalsLock);
+    totals.lit += stats.lit, totals.shadowed += stats.shadowed, totals.marched += stats.marched;
+    stats = SunMapStats();
+  }
+};
+
+SunMap sunMap;
+
+// Whether the shadow ray from origin toward the sun reaches it.
+bool SunVisible(Vec origin) {
+  int hitType = sunMap.size ? sunMap.lookup(origin) : -1;
+  Vec position, normal;
+  if (hitType < 0) hitType = RayMarching(origin, sunDirection, position, normal);
+  return hitType == HIT_SUN;
+}
+
+struct Hit {
+  int type;
+  Vec position, normal;
+};
+
+// The packet kernels for each instruction set, newest first. A build for
+// a newer target (-mavx2) still carries and can pick the older ones.
+#if defined(X86)
+namespace sse2 {
+#include "PacketKernels.h"
+}
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+namespace sse4 {
+#include "PacketKernels.h"
+}
+#pragma GCC pop_options
+
+#define PACKET_AVX
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace avx2 {
+#include "PacketKernels.h"
+}
+#pragma GCC pop_options
+
+// AVX-512 brings FMA along, whose fused rounding would let packets hit
+// differently from the scalar marcher; keep multiplies and adds apart.
+#pragma GCC push_options
+#pragma GCC target("avx2,avx512f,avx512vl,avx512bw,avx512dq")
+#pragma GCC optimize("fp-contract=off")
+namespace avx512 {
+#include "PacketKernels.h"
+}
+#pragma GCC pop_options
+#undef PACKET_AVX
+#endif
+
+struct PacketIsa {
+  const char* name;
+  bool supported;
+  void (*march)(Vec origins[8], Vec directions[8], int laneMask, Hit hits[8]);
+  void (*query)(Vec positions[8], float distances[8], float hitTypes[8]);
+  void (*rsqrt)(float values[8]);
+};
+
+// In order of preference. avx512 comes after avx2: a packet is 8 lanes,
+// so it gains no width, and it measured slower (0.70 s against 0.68 s).
+std::vector<PacketIsa> &PacketIsas() {
+  static std::vector<PacketIsa> isas;
+#if defined(X86)
+  if (isas.empty()) {
+    __builtin_cpu_init();
+    bool avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+                  && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq");
+    isas = {
+      {"avx2", (bool)__builtin_cpu_supports("avx2"),
+       avx2::MarchPacket, avx2::QueryPacket, avx2::RSqrtPacket},
+      {"avx512", avx512, avx512::MarchPacket, avx512::QueryPacket, avx512::RSqrtPacket},
+      {"sse4", (bool)__builtin_cpu_supports("sse4.2"),
+       sse4::MarchPacket, sse4::QueryPacket, sse4::RSqrtPacket},
+      {"sse2", true, sse2::MarchPacket, sse2::QueryPacket, sse2::RSqrtPacket},
+    };
+  }
+#endif
+  return isas;
+}
+
+// The variant the packet paths use: --isa, or the first this CPU runs.
+// Stays NULL in builds without packet kernels.
+PacketIsa* packetIsa = NULL;
+
+bool SelectPacketIsa(const char* name) {
+  for (PacketIsa &isa : PacketIsas())
+    if (isa.supported && (!name || !strcmp(name, isa.name))) {
+      packetIsa = &isa;
+      return true;
     }
+  return !name;
+}
 
-    byte bmpfileheader[14] = { 'B', 'M', 0,0,0,0, 0,0, 0,0, 54, 0, 0,  0};
-    byte bmpinfoheader[40] = { 40,0,0,0, 0,0,0,0, 0,0, 0,0, 1,  0, 24, 0};
-    byte bmppad[3] = {0, 0, 0};
-
-    bmpfileheader[ 2] = (byte)(filesize    );
-    bmpfileheader[ 3] = (byte)(filesize>> 8);
-    bmpfileheader[ 4] = (byte)(filesize>>16);
-    bmpfileheader[ 5] = (byte)(filesize>>24);
-
-    bmpinfoheader[ 4] = (byte)(w    );
-    bmpinfoheader[ 5] = (byte)(w>> 8);
-    bmpinfoheader[ 6] = (byte)(w>>16);
-    bmpinfoheader[ 7] = (byte)(w>>24);
-    bmpinfoheader[ 8] = (byte)(h    );
-    bmpinfoheader[ 9] = (byte)(h>> 8);
-    bmpinfoheader[10] = (byte)(h>>16);
-    bmpinfoheader[11] = (byte)(h>>24);
-
-    f = fopen(fName,"wb");
-    fwrite(bmpfileheader, 1, 14, f);
-    fwrite(bmpinfoheader, 1, 40, f);
-    int lenPad = (4 - (w*3)%4)%4;
-    if (lenPad > 0) {
-        for(int i = 0; i < h; i++) {
-            fwrite(img + w*i*3, 3, w, f);
-            fwrite(bmppad, 1, lenPad, f);
-        }
+// Cosine-weighted direction around normal for a diffuse wall bounce.
+Vec DiffuseDirection(Vec normal, RandomKey key, int bounce) {
+  float sinP, cosP;
+#if defined(FAST_MATH)
+  SinCos2Pi(randomVal(key, bounce, 0), sinP, cosP);
+#else
+  float p = 6.283185 * randomVal(key, bounce, 0);
+  sinP = sinf(p), cosP = cosf(p);
+#endif
+  float c = randomVal(key, bounce, 1);
+  float s = sqrtf(1 - c);
+  float g = normal.z < 0 ? -1 : 1;
+  float u = -1 / (g + normal.z);
+  float v = normal.x * normal.y * u;
+  return Vec(v,
+             g + normal.y * normal.y * u,
+             -normal.y) * (cosP * s)
+         +
+         Vec(1 + g * normal.x * normal.x * u,
+             g * v,
+             -g * normal.x) * (sinP * s) + normal * sqrtf(c);
+}
+
+// Path length and the optional sampling improvements of Trace(), set from
+// the options. With roulette, a path whose throughput has dropped below .2
+// survives each further bounce with probability throughput / .2 and is
+// scaled up to stay unbiased. With MIS, every wall hit also samples a point
+// of the sky directly, and that sample and the cosine bounce reaching the
+// sky are weighed against each other with the power heuristic.
+int maxDepth = 3;
+bool russianRoulette = false, skyMis = false;
+
+// The sky shows through the ceiling at y = 19.9 between the planks, in 3
+// wide strips around x = 8k, |k| <= 3, for |z| < 25 (see RoomDistance()).
+// SkySample() picks a point uniformly on them. The outer strips overshoot
+// the room, and points there are blocked by its walls.
+#define SKY_AREA (7 * 3 * 50.f)
+
+Vec SkySample(RandomKey key, int bounce) {
+  float s = randomVal(key, bounce, 3) * 21;
+  int strip = (int)(s / 3);
+  return Vec(8 * (strip - 3) + s - 3 * strip - 1.5f, 19.9, 50 * randomVal(key, bounce, 4) - 25);
+}
+
+// Solid angle density of SkySample() for a sky point distance away along
+// direction.
+float SkyPdf(Vec direction, float distance) {
+  return distance * distance / (SKY_AREA * direction.y);
+}
+
+// A path through the card. Trace() follows one through all its bounces,
+// the wavefront engine moves many along a stage at a time, and both shade
+// each hit with the functions below, so they cannot drift apart.
+struct Path {
+  Vec origin, direction, color, attenuation = 1;
+  RandomKey key;
+  float bouncePdf = 0; // Of the last diffuse bounce, 0 when it was a mirror.
+  Vec lastWall;
+};
+
+// False when roulette ends the path before its bounce.
+bool SurvivesRoulette(Path &path, int bounce) {
+  if (!russianRoulette || bounce <= 2) return true;
+  Vec &attenuation = path.attenuation;
+  float survival = fmaxf(attenuation.x, fmaxf(attenuation.y, attenuation.z)) / .2f;
+  if (survival < 1) {
+    if (randomVal(path.key, bounce, 2) >= survival) return false;
+    attenuation = attenuation * (1 / survival);
+  }
+  return true;
+}
+
+// Specular bounce on a letter. No color acc.
+void ShadeLetter(Path &path, Hit &hit) {
+  Vec normal = hit.normal;
+  path.direction = path.direction + normal * ( normal % path.direction * -2);
+  path.origin = hit.position + path.direction * 0.1;
+  path.attenuation = path.attenuation * 0.2; // Attenuation via distance traveled.
+  path.bouncePdf = 0;
+}
+
+// Diffuse bounce on a wall, with the MIS sky sample marched on the spot.
+// Returns the cosine toward the sun; where it is positive, the shadow ray
+// from shadowOrigin decides whether AddSunlight() applies.
+float ShadeWall(Path &path, Hit &hit, int bounce, Vec &shadowOrigin) {
+  Vec normal = hit.normal;
+  float incidence = normal % sunDirection;
+  path.direction = DiffuseDirection(normal, path.key, bounce);
+  path.origin = hit.position + path.direction * .1;
+  path.attenuation = path.attenuation * 0.2;
+  if (skyMis) {
+    // The albedo .2 over pi times the cosine is attenuation times the
+    // cosine density of bouncing toward the sky point.
+    Vec toSky = SkySample(path.key, bounce) + hit.position * -1, skyPosition, skyNormal;
+    float distance = sqrtf(toSky % toSky);
+    Vec skyDirection = toSky * (1 / distance);
+    float cosinePdf = (normal % skyDirection) * (1 / 3.14159265f);
+    INSTRUMENTED(pixelCost.shadowRays += cosinePdf > 0);
+    if (cosinePdf > 0 &&
+        RayMarching(hit.position + normal * .1, skyDirection, skyPosition, skyNormal) == HIT_SUN) {
+      float skyPdf = SkyPdf(skyDirection, distance);
+      path.color = path.color + path.attenuation * skyColor
+                                * (cosinePdf * skyPdf / (cosinePdf * cosinePdf + skyPdf * skyPdf));
+    }
+    path.bouncePdf = (normal % path.direction) * (1 / 3.14159265f);
+    path.lastWall = hit.position;
+  }
+  shadowOrigin = hit.position + normal * .1;
+  return incidence;
+}
+
+void AddSunlight(Path &path, float incidence) {
+  path.color = path.color + path.attenuation * sunColor * incidence;
+}
+
+// The path has reached the sky at hit, which ends it.
+void ShadeSky(Path &path, Hit &hit) {
+  float weight = 1;
+  if (skyMis && path.bouncePdf > 0) {
+    Vec offset = hit.position + path.lastWall * -1;
+    float skyPdf = SkyPdf(path.direction, sqrtf(offset % offset));
+    weight = path.bouncePdf * path.bouncePdf / (path.bouncePdf * path.bouncePdf + skyPdf * skyPdf);
+  }
+  path.color = path.color + path.attenuation * skyColor * weight;
+}
+
+// firstHit, when given, is the already marched primary ray. primaryHit,
+// when given, receives the primary ray's hit for the feature buffers.
+Vec Trace(Vec origin, Vec direction, RandomKey key, const Hit* firstHit = NULL,
+          Hit* primaryHit = NULL) {
+  Path path;
+  path.origin = origin, path.direction = direction, path.key = key;
+  INSTRUMENTED(++pixelCost.samples);
+
+  for (int bounce = 1; bounce <= maxDepth; ++bounce) {
+    if (!SurvivesRoulette(path, bounce)) break;
+    Hit hit;
+    if (bounce == 1 && firstHit) {
+      hit = *firstHit;
     } else {
-        for(int i = 0; i < h; i++) {
-            fwrite(img + (w*i*3), 3, w, f);
-        }
-    }   
-
-    delete[] img;
-    fclose(f);
-}
-
-int main() {
-  // byte testData[] = { 255, 0, 0, 255, 0, 0, 255, 0, 0, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 
-  // 255, 0, 0, 255, 0, 0, 255, 0, 0, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 
-  // 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 
-  // 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 
-  // 255, 0, 0, 255, 0, 0, 255, 0, 0, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 
-  // 255, 0, 0, 255, 0, 0, 255, 0, 0, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 
-  // 255, 0, 0, 255, 0, 0, 255, 0, 0, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 
-  // 255, 0, 0, 255, 0, 0, 255, 0, 0, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 
-  // 255, 0, 0, 255, 0, 0, 255, 0, 0, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127
-  // };
-  // createBMP(testData, 16, 9, "test.bmp");
-  // return 0;
-
-//  int w = 960, h = 540, samplesCount = 16;
+      hit.type = RayMarching(path.origin, path.direction, hit.position, hit.normal,
+                             bounce == 1 ? pixelFootprint : 0);
+    }
+    if (bounce == 1 && primaryHit) *primaryHit = hit;
+    INSTRUMENTED(++pixelCost.bounces; ++pixelCost.hits[hit.type]);
+    if (hit.type == HIT_NONE) break; // No hit. This is over, return color.
+    if (hit.type == HIT_LETTER) ShadeLetter(path, hit);
+    if (hit.type == HIT_WALL) {
+      Vec shadowOrigin;
+      float incidence = ShadeWall(path, hit, bounce, shadowOrigin);
+      INSTRUMENTED(pixelCost.shadowRays += incidence > 0);
+      if (incidence > 0 && SunVisible(shadowOrigin)) AddSunlight(path, incidence);
+    }
+    if (hit.type == HIT_SUN) {
+      ShadeSky(path, hit);
+      break;
+    }
+  }
+  return path.color;
+}
+
+struct Options {
   int w = 240, h = 135, samplesCount = 24;
-  Vec position(-22, 5, 25);
-  Vec goal = !(Vec(-3, 4, 0) + position * -1);
-  Vec left = !Vec(goal.z, 0, -goal.x) * (1. / w);
+  int threadCount = 0; // 0 picks one thread per hardware core.
+  bool simd = false;   // March primary rays in packets of eight.
+  const char* isa = NULL;  // Packet kernel variant, NULL for the newest supported.
+  bool finiteDifferenceNormals = false;
+  int marchStrategy = MARCH_CLASSIC;
+  bool prepass = false; // Seed primary rays from a cone-marched depth prepass.
+  int sunMapSize = 0;     // Sun visibility map cells per side, 0 = off.
+  int brickMapKb = 0;     // Empty-space brick map budget in KB, 0 = off.
+  bool wavefront = false; // Render with the wavefront engine instead of Trace().
+  bool adaptive = false;  // Per-pixel sample counts driven by variance.
+  int minSamples = 16, maxSamples = 256;
+  float tolerance = 160;  // Confidence interval target in display levels.
+  int maxDepth = 3;       // Bounces per path.
+  bool roulette = false;  // End low-throughput paths early, without bias.
+  bool mis = false;       // Sample the sky at wall hits, weighed by MIS.
+  int denoise = 0;        // A-trous levels over the feature buffers, 0 = off.
+  bool progressive = false; // Passes of doubling samples, writing each image.
+  float budget = 0;       // Progressive wall-clock limit in seconds, 0 = none.
+  const char* checkpoint = NULL; // Float accumulation file to resume and save.
+  int passSamples = 8;    // Samples per pixel between checkpoints.
+  int partIndex = 0, partCount = 1; // This process renders tile range K of N.
+  bool merge = false;     // Sum the accumulation files in mergeInputs.
+  std::vector<const char*> mergeInputs;
+  bool stepHistogram = false;
+  bool bench = false;     // Print timings of fixed renders as JSON.
+  bool heatmaps = false;  // Per-pixel cost images, needs -DINSTRUMENT.
+  const char* compare = NULL; // Golden image to check the output against.
+  float minPsnr = 40;     // Lowest per-channel PSNR that passes, in dB.
+  int psnrBlock = 1;      // Compare means of blocks this many pixels wide.
+  bool selfTest = false;
+  const char* scene = NULL; // Scene file to render instead of the card.
+  bool interpret = false;   // Run the card as a scene program.
+  const char* output = "cardCPP.bmp";
+};
+
+#define TILE_SIZE 16 // Frame is split into square tiles handed out to threads.
+
+struct Camera {
+  Vec position, goal, left, up;
+  int w, h;
+  float footprint; // Angular radius of a pixel: half its width, .5 / w.
+};
+
+Camera MakeCamera(int w, int h) {
+  Camera camera;
+  camera.w = w;
+  camera.h = h;
+  camera.position = Vec(-22, 5, 25);
+  camera.goal = !(Vec(-3, 4, 0) + camera.position * -1);
+  camera.left = !Vec(camera.goal.z, 0, -camera.goal.x) * (1. / w);
+  camera.footprint = .5 / w;
 
   // Cross-product to get the up vector
-  Vec up(goal.y * left.z - goal.z * left.y,
-      goal.z * left.x - goal.x * left.z,
-      goal.x * left.y - goal.y * left.x);
-
-  //printf("P6 %d %d 255 ", w, h);
-  byte* pixels = new byte[3*w*h];
-  for (int y = h; y > 0; --y) {
-    for (int x = w; x > 0; --x) {
-      Vec color;
-      for (int p = samplesCount; p--;) {
-        color = color + Trace(position, !(goal + left * (x - w / 2 + randomVal()) + up * (y - h / 2 + randomVal())));
-      }
+  Vec &goal = camera.goal, &left = camera.left;
+  camera.up = Vec(goal.y * left.z - goal.z * left.y,
+                  goal.z * left.x - goal.x * left.z,
+                  goal.x * left.y - goal.y * left.x);
+  return camera;
+}
+
+// Work-stealing tile queues. Every worker starts with a contiguous run of
+// tiles and takes from the front of its own deque. Once it runs dry it steals
+// from the back of another worker's deque, because tiles with letters or
+// ceiling planks take far more marching steps than open wall does.
+struct TileScheduler {
+  std::vector<std::deque<int>> queues;
+  std::vector<std::mutex> locks;
+
+  TileScheduler(int tileCount, int workerCount)
+      : queues(workerCount), locks(workerCount) {
+    for (int i = 0; i < tileCount; ++i)
+      queues[(long long)i * workerCount / tileCount].push_back(i);
+  }
 
-      // Reinhard tone mapping
-      color = color * (1. / samplesCount) + 14. / 241;
-      Vec o = color + 1;
-      color = Vec(color.x / o.x, color.y / o.y, color.z / o.z) * 255;
-      int index = 3*(w*y - w + x - 1);
-      pixels[index    ] = (byte)color.x;
-      pixels[index + 1] = (byte)color.y;
-      pixels[index + 2] = (byte)color.z;
-      //if (x < w/2 && y < h/2) printf("%d %d \n", x, y);
-      //printf("%c%c%c", (int) color.x, (int) color.y, (int) color.z);
+  bool next(int worker, int &tile) {
+    int workerCount = queues.size();
+    for (int i = 0; i < workerCount; ++i) {
+      int victim = (worker + i) % workerCount;
+      std::lock_guard<std::mutex> lock(locks[victim]);
+      std::deque<int> &queue = queues[victim];
+      if (queue.empty()) continue;
+      if (victim == worker) tile = queue.front(), queue.pop_front();
+      else tile = queue.back(), queue.pop_back();
+      return true;
     }
+    return false; // No tile is ever added, so empty queues mean we are done.
   }
-  createBMP(pixels, w, h, "cardCPP.bmp");
+};
+
+// Finished 8-bit RGB pixels of the w x h region whose lower left pixel is
+// (x0 + 1, y0 + 1): a single tile while rendering, or the whole frame.
+struct Framebuffer {
+  byte* data;
+  int x0, y0, w, h;
+
+  byte* at(int x, int y) { return data + 3 * ((y - 1 - y0) * w + x - 1 - x0); }
+};
+
+// Writes tiles straight to their place in a BMP or PPM file, in whatever
+// order they finish, so no frame sized buffer is ever held. The file is
+// sized up front and every tile row goes out with one positional write.
+// Both formats are mirrored horizontally like the original output: pixel
+// x lands in column w - x. BMP rows run bottom-up like y, PPM rows top-down.
+struct ImageSink {
+  FILE* file = NULL;
+  int w, h, rowBytes;
+  long headerBytes;
+  bool ppm, failed = false;
+#if defined(_WIN32)
+  std::mutex lock; // No pwrite(), so seek and write must not interleave.
+#endif
+
+  bool open(const char* name, int width, int height) {
+    w = width, h = height;
+    const char* extension = strrchr(name, '.');
+    ppm = extension && !strcmp(extension, ".ppm");
+    file = fopen(name, "wb");
+    if (!file) return false;
+    if (ppm) {
+      rowBytes = 3 * w;
+      headerBytes = fprintf(file, "P6 %d %d 255 ", w, h);
+    } else {
+      rowBytes = (3 * w + 3) & ~3;
+      long size = 54 + (long)rowBytes * h;
+      byte header[54] = {'B', 'M', 0,0,0,0, 0,0, 0,0, 54,0,0,0, 40,0,0,0,
+                         0,0,0,0, 0,0,0,0, 1,0, 24,0};
+      for (int i = 0; i < 4; ++i) {
+        header[ 2 + i] = (byte)(size >> 8 * i);
+        header[18 + i] = (byte)(w >> 8 * i);
+        header[22 + i] = (byte)(h >> 8 * i);
+      }
+      headerBytes = fwrite(header, 1, 54, file);
+    }
+    // Writing the last byte sizes the file, so the BMP row padding that no
+    // tile ever writes reads back as zeros.
+    byte zero = 0;
+    fseek(file, headerBytes + (long)rowBytes * h - 1, SEEK_SET);
+    fwrite(&zero, 1, 1, file);
+    fflush(file);
+    return !ferror(file);
+  }
+
+  // Converts one row of a tile to file order on the stack and writes it.
+  void write(Framebuffer &pixels) {
+    byte row[3 * TILE_SIZE];
+    for (int y = pixels.y0 + 1; y <= pixels.y0 + pixels.h; ++y) {
+      for (int i = 0; i < pixels.w; ++i) {
+        byte* source = pixels.at(pixels.x0 + pixels.w - i, y);
+        row[3 * i    ] = source[ppm ? 0 : 2];
+        row[3 * i + 1] = source[1];
+        row[3 * i + 2] = source[ppm ? 2 : 0];
+      }
+      long offset = headerBytes + (long)rowBytes * (ppm ? h - y : y - 1)
+                    + 3 * (w - pixels.x0 - pixels.w);
+#if defined(_WIN32)
+      std::lock_guard<std::mutex> guard(lock);
+      fseek(file, offset, SEEK_SET);
+      fwrite(row, 3, pixels.w, file);
+#else
+      if (pwrite(fileno(file), row, 3 * pixels.w, offset) < 0) failed = true;
+#endif
+    }
+  }
+
+  bool close() {
+#if defined(_WIN32)
+    failed |= ferror(file) != 0;
+#endif
+    failed |= fclose(file) != 0;
+    file = NULL;
+    return !failed;
+  }
+};
+
+// Reads a 24-bit BMP or a PPM, such as ImageSink writes, into rgb in
+// Framebuffer order: pixel (x, y) at 3 * (w * (y - 1) + x - 1).
+bool ReadImage(const char* name, int &w, int &h, std::vector<byte> &rgb) {
+  FILE* file = fopen(name, "rb");
+  if (!file) return false;
+  byte header[54];
+  bool ppm = false, ok = fread(header, 1, 2, file) == 2;
+  long offset = 0, rowBytes = 0;
+  if (ok && header[0] == 'P' && header[1] == '6') {
+    int maximum;
+    ok = fscanf(file, "%d %d %d", &w, &h, &maximum) == 3 && maximum == 255 && fgetc(file) != EOF;
+    ppm = true, offset = ftell(file), rowBytes = 3 * w;
+  } else if (ok && header[0] == 'B' && header[1] == 'M') {
+    ok = fread(header + 2, 1, 52, file) == 52 && header[28] == 24;
+    auto field = [&](int at) { return header[at] | header[at + 1] << 8 | header[at + 2] << 16
+                                      | header[at + 3] << 24; };
+    offset = field(10), w = field(18), h = field(22), rowBytes = (3 * w + 3) & ~3;
+  } else {
+    ok = false;
+  }
+  ok = ok && w > 0 && h > 0;
+  std::vector<byte> row(ok ? rowBytes : 0);
+  if (ok) rgb.assign(3 * w * h, 0);
+  for (int r = 0; ok && r < h; ++r) {
+    ok = !fseek(file, offset + rowBytes * r, SEEK_SET) && fread(row.data(), 1, rowBytes, file) == (size_t)rowBytes;
+    int y = ppm ? h - r : r + 1;
+    for (int c = 0; ok && c < w; ++c)
+      for (int i = 0; i < 3; ++i)
+        rgb[3 * (w * (y - 1) + w - c - 1) + i] = row[3 * c + (ppm ? i : 2 - i)];
+  }
+  fclose(file);
+  return ok;
+}
+
+// Pixel (x, y) is 1-based with y going up, as in the original nested loop.
+Vec PrimaryDirection(Camera &camera, int x, int y, RandomKey key) {
+  return !(camera.goal + camera.left * (x - camera.w / 2 + randomVal(key, 0, 0))
+                       + camera.up * (y - camera.h / 2 + randomVal(key, 0, 1)));
+}
+
+// Index of a pass's first sample, so that a resumed render draws the same
+// samples an uninterrupted one would.
+int firstSample = 0;
+
+RandomKey PixelKey(Camera &camera, int x, int y, int sample) {
+  RandomKey key = {(unsigned int)(camera.w * (y - 1) + x - 1),
+                   (unsigned int)(firstSample + sample)};
+  return key;
+}
+
+// Optional coarse depth prepass. For every PREPASS_BLOCK square block of
+// pixels one cone, wide enough to hold every jittered primary ray of the
+// block, is marched from the camera until it nears a surface. Everything up
+// to that distance is empty for all of the block's rays, so their marching
+// starts there instead of at the camera.
+#define PREPASS_BLOCK 8
+
+struct DepthPrepass {
+  int blocksX = 0, blocksY = 0; // 0 when the prepass is off.
+  std::vector<float> start;
+
+  // Returns how far the cone gets while every point in it stays more than
+  // the hit threshold away from the scene. A sphere of radius d at distance
+  // t covers the cone up to (t + d) / (1 + tanAngle).
+  static float ConeMarch(Vec origin, Vec axis, float tanAngle) {
+    int hitType;
+    float t = 0;
+    for (int i = 0; i < 256 && t < 100; ++i) {
+      float d = QueryDatabase(origin + axis * t, hitType) - .01;
+      float step = (d - t * tanAngle) / (1 + tanAngle);
+      if (step < .01) break;
+      t += step;
+    }
+    return t;
+  }
+
+  void build(Camera &camera) {
+    blocksX = (camera.w + PREPASS_BLOCK - 1) / PREPASS_BLOCK;
+    blocksY = (camera.h + PREPASS_BLOCK - 1) / PREPASS_BLOCK;
+    start.resize(blocksX * blocksY);
+
+    // Jittered rays of a block leave the image plane (at distance 1 or
+    // more) within half a block diagonal of the center ray, one pixel being
+    // 1/w wide. The sine of their angle to it is at most that offset.
+    float offset = PREPASS_BLOCK * .7072 / camera.w;
+    float tanAngle = offset / sqrtf(1 - offset * offset) * 1.01;
+    for (int by = 0; by < blocksY; ++by)
+      for (int bx = 0; bx < blocksX; ++bx) {
+        float cx = bx * PREPASS_BLOCK + 1 + PREPASS_BLOCK / 2. - camera.w / 2;
+        float cy = by * PREPASS_BLOCK + 1 + PREPASS_BLOCK / 2. - camera.h / 2;
+        Vec axis = !(camera.goal + camera.left * cx + camera.up * cy);
+        start[by * blocksX + bx] = ConeMarch(camera.position, axis, tanAngle);
+      }
+  }
+
+  // Safe start distance for primary rays of 1-based pixel (x, y).
+  float startDistance(int x, int y) {
+    if (!blocksX) return 0;
+    return start[(y - 1) / PREPASS_BLOCK * blocksX + (x - 1) / PREPASS_BLOCK];
+  }
+};
+
+DepthPrepass depthPrepass;
+
+// Moves a finished temporary file over name in one step, so that nobody
+// ever sees a half-written name.
+bool ReplaceFile(const char* temporary, const char* name) {
+#if defined(_WIN32)
+  remove(name); // rename() does not replace files here.
+#endif
+  return !rename(temporary, name);
+}
+
+// Optional float accumulation buffer behind --checkpoint. While it is on,
+// StorePixel() adds each pixel's sample sum and count here instead of tone
+// mapping it, and main() saves the buffer after every pass.
+#define ACCUMULATION_MAGIC "PTACC1\0"
+
+struct Accumulation {
+  int w = 0, h = 0; // 0 while pixels go straight to bytes.
+  std::vector<Vec> sums;
+  std::vector<unsigned int> samples;
+
+  void add(int x, int y, Vec color, int samplesCount) {
+    int index = w * (y - 1) + x - 1;
+    sums[index] = sums[index] + color;
+    samples[index] += samplesCount;
+  }
+
+  void add(Accumulation &other) {
+    for (size_t i = 0; i < sums.size(); ++i) {
+      sums[i] = sums[i] + other.sums[i];
+      samples[i] += other.samples[i];
+    }
+  }
+
+  // The file is the 8 byte magic, w and h, the w*h sums as three floats and
+  // the w*h sample counts, all in native byte order. It is written next to
+  // the old one and renamed over it, so a kill mid-save loses nothing.
+  bool save(const char* name) {
+    std::string temporary = std::string(name) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) return false;
+    int size[2] = {w, h};
+    fwrite(ACCUMULATION_MAGIC, 1, 8, file);
+    fwrite(size, sizeof(int), 2, file);
+    fwrite(sums.data(), sizeof(Vec), sums.size(), file);
+    fwrite(samples.data(), sizeof(unsigned int), samples.size(), file);
+    bool ok = !ferror(file);
+    ok = !fclose(file) && ok;
+    return ok && ReplaceFile(temporary.c_str(), name);
+  }
+
+  // Starts from zero when there is no file yet, or no name.
+  bool load(const char* name, int width, int height) {
+    w = width, h = height;
+    sums.assign(w * h, Vec());
+    samples.assign(w * h, 0);
+    FILE* file = name ? fopen(name, "rb") : NULL;
+    if (!file) return true;
+    char magic[8];
+    int size[2];
+    bool ok = fread(magic, 1, 8, file) == 8 && !memcmp(magic, ACCUMULATION_MAGIC, 8)
+              && fread(size, sizeof(int), 2, file) == 2 && size[0] == w && size[1] == h
+              && fread(sums.data(), sizeof(Vec), sums.size(), file) == sums.size()
+              && fread(samples.data(), sizeof(unsigned int), samples.size(), file)
+                 == samples.size();
+    fclose(file);
+    return ok;
+  }
+};
+
+Accumulation accumulation;
+
+// Optional first-hit feature buffers behind --denoise, summed over each
+// pixel's samples like its color: the normal, material and distance of
+// whatever the primary ray hit. The shading has no albedo, so the material
+// is one-hot over letter, wall and sky, and its sum is the sample count.
+struct FeatureBuffers {
+  int w = 0; // 0 while they are off.
+  std::vector<Vec> normals, materials;
+  std::vector<float> depths;
+
+  void reset(int width, int height) {
+    w = width;
+    normals.assign(width * height, Vec());
+    materials.assign(width * height, Vec());
+    depths.assign(width * height, 0);
+  }
+
+  void add(int x, int y, Vec eye, Hit hit) {
+    int index = w * (y - 1) + x - 1;
+    Vec offset = hit.position + eye * -1;
+    if (hit.type != HIT_NONE) normals[index] = normals[index] + hit.normal;
+    materials[index] = materials[index] + Vec(hit.type == HIT_LETTER, hit.type == HIT_WALL,
+                                              hit.type == HIT_SUN || hit.type == HIT_NONE);
+    depths[index] += sqrtf(offset % offset);
+  }
+};
+
+FeatureBuffers features;
+
+// Applies Reinhard tone mapping to a pixel's mean and stores it as bytes.
+void ToneMap(Vec color, byte pixel[]) {
+  color = color + 14. / 241;
+  Vec o = color + 1;
+  color = Vec(color.x / o.x, color.y / o.y, color.z / o.z) * 255;
+  pixel[0] = (byte)color.x;
+  pixel[1] = (byte)color.y;
+  pixel[2] = (byte)color.z;
+}
+
+void StorePixel(Camera &camera, int x, int y, Vec color, int samplesCount, Framebuffer &pixels) {
+  if (accumulation.w) return accumulation.add(x, y, color, samplesCount);
+  ToneMap(color * (1. / samplesCount), pixels.at(x, y));
+}
+
+void RenderPixel(Camera &camera, Options &options, int x, int y, Framebuffer &pixels) {
+  INSTRUMENTED(PixelCostScope cost(camera.w * (y - 1) + x - 1));
+  Vec color;
+  for (int p = options.samplesCount; p--;) {
+    RandomKey key = PixelKey(camera, x, y, p);
+    Vec direction = PrimaryDirection(camera, x, y, key);
+    Hit primary;
+    color = color + Trace(camera.position + direction * depthPrepass.startDistance(x, y),
+                          direction, key, NULL, features.w ? &primary : NULL);
+    if (features.w) features.add(x, y, camera.position, primary);
+  }
+  StorePixel(camera, x, y, color, options.samplesCount, pixels);
+}
+
+// Samples taken by each pixel in adaptive mode, for the report.
+std::vector<int> sampleCounts;
+
+// True once the 95% confidence interval of every channel's mean, carried
+// through the slope of the Reinhard curve in StorePixel(), spans no more
+// than tolerance display levels. variance is of a single sample.
+bool Converged(Vec mean, Vec variance, int n, float tolerance) {
+  float means[3] = {mean.x, mean.y, mean.z}, variances[3] = {variance.x, variance.y, variance.z};
+  for (int i = 0; i < 3; ++i) {
+    float interval = 1.96 * sqrtf(variances[i] / n);
+    float o = means[i] + 14. / 241 + 1;
+    if (255 * interval / (o * o) > tolerance) return false;
+  }
+  return true;
+}
+
+// Running mean and sum of squared deviations of one pixel (Welford).
+struct PixelEstimate {
+  Vec mean, m2;
+  int n = 0;
+  bool done = false;
+
+  void add(Vec color) {
+    Vec delta = color + mean * -1;
+    mean = mean + delta * (1. / ++n);
+    m2 = m2 + delta * (color + mean * -1);
+  }
+};
+
+// Every pixel of the tile takes minSamples, then rounds of
+// ADAPTIVE_BATCH more until it has converged or has maxSamples. A
+// pixel's own variance from a few samples is a poor guide: a shadowed
+// corner can return nothing but black while the rare path to the sun
+// dominates its mean, and a lucky run stops a noisy pixel early. So the
+// variance tested is the larger of the pixel's own and the mean over its
+// 3x3 neighbours in the tile, which borrow each other's samples.
+#define ADAPTIVE_BATCH 8
+
+void RenderTileAdaptive(Camera &camera, Options &options, int x0, int y0, int x1, int y1,
+                        Framebuffer &pixels) {
+  int tileW = x1 - x0, tileH = y1 - y0;
+  std::vector<PixelEstimate> estimates(tileW * tileH);
+  std::vector<Vec> variances(tileW * tileH);
+  for (int target = options.minSamples, active = 1; active; target += ADAPTIVE_BATCH) {
+    if (target > options.maxSamples) target = options.maxSamples;
+    for (int i = 0; i < tileW * tileH; ++i) {
+      PixelEstimate &e = estimates[i];
+      int x = x0 + i % tileW + 1, y = y0 + i / tileW + 1;
+      INSTRUMENTED(PixelCostScope cost(camera.w * (y - 1) + x - 1));
+      for (; !e.done && e.n < target; ) {
+        RandomKey key = PixelKey(camera, x, y, e.n);
+        Vec direction = PrimaryDirection(camera, x, y, key);
+        Hit primary;
+        e.add(Trace(camera.position + direction * depthPrepass.startDistance(x, y),
+                    direction, key, NULL, features.w ? &primary : NULL));
+        if (features.w) features.add(x, y, camera.position, primary);
+      }
+      variances[i] = e.m2 * (1. / (e.n - 1));
+    }
+    active = 0;
+    for (int i = 0; i < tileW * tileH; ++i) {
+      PixelEstimate &e = estimates[i];
+      if (e.done) continue;
+      int px = i % tileW, py = i / tileW, count = 0;
+      Vec pooled;
+      for (int y = py - 1; y <= py + 1; ++y)
+        for (int x = px - 1; x <= px + 1; ++x)
+          if (x >= 0 && x < tileW && y >= 0 && y < tileH)
+            pooled = pooled + variances[tileW * y + x], ++count;
+      pooled = pooled * (1. / count);
+      Vec own = variances[i];
+      Vec variance(fmaxf(own.x, pooled.x), fmaxf(own.y, pooled.y), fmaxf(own.z, pooled.z));
+      e.done = e.n >= options.maxSamples || Converged(e.mean, variance, e.n, options.tolerance);
+      active += !e.done;
+    }
+  }
+  for (int i = 0; i < tileW * tileH; ++i) {
+    int x = x0 + i % tileW + 1, y = y0 + i / tileW + 1;
+    StorePixel(camera, x, y, estimates[i].mean, 1, pixels);
+    sampleCounts[camera.w * (y - 1) + x - 1] = estimates[i].n;
+  }
+}
+
+// Prints how many pixels took how many samples.
+void ReportSampleCounts(Options &options) {
+  int bins = 16, binWidth = (options.maxSamples + bins - 1) / bins;
+  std::vector<long long> histogram(bins);
+  long long total = 0;
+  for (int n : sampleCounts) ++histogram[(n - 1) / binWidth], total += n;
+  fprintf(stderr, "adaptive: %lld samples, %.2f per pixel on average\n",
+          total, (double)total / sampleCounts.size());
+  for (int bin = 0; bin < bins; ++bin)
+    if (histogram[bin])
+      fprintf(stderr, "  %3d-%-3d samples %8lld pixels\n",
+              bin * binWidth + 1, (bin + 1) * binWidth, histogram[bin]);
+}
+
+// Renders count <= 8 neighbouring pixels of one row. For each sample their
+// primary rays are marched together as a packet, and the bounces continue
+// per pixel in Trace().
+void RenderPacket(Camera &camera, Options &options, int x, int y, int count, Framebuffer &pixels) {
+  Vec colors[8], directions[8], origins[8];
+  Hit hits[8];
+  for (int p = options.samplesCount; p--;) {
+    for (int i = 0; i < 8; ++i) {
+      directions[i] = i < count ? PrimaryDirection(camera, x + i, y, PixelKey(camera, x + i, y, p))
+                                : Vec(1, 0, 0);
+      origins[i] = camera.position
+                   + directions[i] * (i < count ? depthPrepass.startDistance(x + i, y) : 0);
+    }
+    packetIsa->march(origins, directions, (1 << count) - 1, hits);
+    for (int i = 0; i < count; ++i) {
+      colors[i] = colors[i] + Trace(camera.position, directions[i],
+                                    PixelKey(camera, x + i, y, p), &hits[i]);
+      if (features.w) features.add(x + i, y, camera.position, hits[i]);
+    }
+  }
+  for (int i = 0; i < count; ++i)
+    StorePixel(camera, x + i, y, colors[i], options.samplesCount, pixels);
+}
+
+// Wavefront engine. Instead of following one path through all of its
+// bounces like Trace(), all paths of a tile advance together one stage at a
+// time: roulette, extend (march), shade letter, shade wall, shadow. Every
+// stage is a tight loop over a queue of path indices sorted by hit type,
+// and with --simd the two marching stages take their queues eight rays at
+// a time. The MIS sky rays of walls are marched while shading. Without
+// --simd the image matches Trace() bit for bit.
+struct PathState : Path {
+  Hit hit;              // Of the extension ray, then of the shadow ray.
+  Vec shadowOrigin;
+  float incidence;
+};
+
+void MarchQueue(std::vector<PathState> &paths, std::vector<int> &queue, bool shadow, bool simd,
+                float footprint = 0) {
+  if (!simd) {
+    for (int i : queue) {
+      PathState &path = paths[i];
+      path.hit.type = shadow
+          ? RayMarching(path.shadowOrigin, sunDirection, path.hit.position, path.hit.normal)
+          : RayMarching(path.origin, path.direction, path.hit.position, path.hit.normal,
+                        footprint);
+    }
+    return;
+  }
+  for (size_t first = 0; first < queue.size(); first += 8) {
+    int count = queue.size() - first < 8 ? queue.size() - first : 8;
+    Vec origins[8], directions[8];
+    Hit hits[8];
+    for (int i = 0; i < 8; ++i) {
+      PathState &path = paths[queue[first + min(i, count - 1)]];
+      origins[i] = shadow ? path.shadowOrigin : path.origin;
+      directions[i] = shadow ? sunDirection : path.direction;
+    }
+    packetIsa->march(origins, directions, (1 << count) - 1, hits);
+    for (int i = 0; i < count; ++i) paths[queue[first + i]].hit = hits[i];
+  }
+}
+
+void RenderTileWavefront(Camera &camera, Options &options, int x0, int y0, int x1, int y1,
+                         Framebuffer &pixels) {
+  int samplesCount = options.samplesCount, tileW = x1 - x0;
+  std::vector<PathState> paths(tileW * (y1 - y0) * samplesCount);
+  std::vector<int> extend, letters, walls, shadows, marched;
+
+  for (int y = y0; y < y1; ++y)
+    for (int x = x0; x < x1; ++x)
+      for (int p = 0; p < samplesCount; ++p) {
+        int i = ((y - y0) * tileW + x - x0) * samplesCount + p;
+        PathState &path = paths[i];
+        path.key = PixelKey(camera, x + 1, y + 1, p);
+        path.direction = PrimaryDirection(camera, x + 1, y + 1, path.key);
+        path.origin = camera.position
+                      + path.direction * depthPrepass.startDistance(x + 1, y + 1);
+        extend.push_back(i);
+      }
+
+  for (int bounce = 1; bounce <= maxDepth && !extend.empty(); ++bounce) {
+    size_t survivors = 0;
+    for (int i : extend)
+      if (SurvivesRoulette(paths[i], bounce)) extend[survivors++] = i;
+    extend.resize(survivors);
+    MarchQueue(paths, extend, false, options.simd, bounce == 1 ? pixelFootprint : 0);
+    if (bounce == 1 && features.w)
+      for (int i : extend) {
+        int pixel = i / samplesCount;
+        features.add(x0 + pixel % tileW + 1, y0 + pixel / tileW + 1, camera.position,
+                     paths[i].hit);
+      }
+    letters.clear(), walls.clear();
+    for (int i : extend) {
+      PathState &path = paths[i];
+      if (path.hit.type == HIT_LETTER) letters.push_back(i);
+      if (path.hit.type == HIT_WALL) walls.push_back(i);
+      if (path.hit.type == HIT_SUN) ShadeSky(path, path.hit);
+    }
+
+    extend.clear(), shadows.clear();
+    for (int i : letters) {
+      ShadeLetter(paths[i], paths[i].hit);
+      extend.push_back(i);
+    }
+    for (int i : walls) { // Diffuse bounce plus a shadow ray to the sun.
+      PathState &path = paths[i];
+      path.incidence = ShadeWall(path, path.hit, bounce, path.shadowOrigin);
+      if (path.incidence > 0) shadows.push_back(i);
+      extend.push_back(i);
+    }
+
+    // Shadow rays the sun map answers skip the march.
+    marched.clear();
+    for (int i : shadows) {
+      PathState &path = paths[i];
+      path.hit.type = sunMap.size ? sunMap.lookup(path.shadowOrigin) : -1;
+      if (path.hit.type < 0) marched.push_back(i);
+    }
+    MarchQueue(paths, marched, true, options.simd);
+    for (int i : shadows) {
+      PathState &path = paths[i];
+      if (path.hit.type == HIT_SUN) AddSunlight(path, path.incidence);
+    }
+  }
+
+  // Sum the samples in the same order as RenderPixel().
+  for (int y = y0; y < y1; ++y)
+    for (int x = x0; x < x1; ++x) {
+      Vec color;
+      for (int p = samplesCount; p--;)
+        color = color + paths[((y - y0) * tileW + x - x0) * samplesCount + p].color;
+      StorePixel(camera, x + 1, y + 1, color, samplesCount, pixels);
+    }
+}
+
+// Tiles covering the frame, the last ones in each row and column cut short.
+int TileCount(Camera &camera) {
+  return ((camera.w + TILE_SIZE - 1) / TILE_SIZE) * ((camera.h + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+// The region of the frame covered by a tile, stored in data.
+Framebuffer TileRegion(Camera &camera, int tile, byte data[]) {
+  int tilesX = (camera.w + TILE_SIZE - 1) / TILE_SIZE;
+  Framebuffer region = {data, tile % tilesX * TILE_SIZE, tile / tilesX * TILE_SIZE};
+  region.w = min(TILE_SIZE, camera.w - region.x0);
+  region.h = min(TILE_SIZE, camera.h - region.y0);
+  return region;
+}
+
+// Renders a tile into pixels, which hold either just that tile or the frame.
+void RenderTile(Camera &camera, Options &options, int tile, Framebuffer &pixels) {
+  Framebuffer region = TileRegion(camera, tile, NULL);
+  int x0 = region.x0, y0 = region.y0, x1 = x0 + region.w, y1 = y0 + region.h;
+  if (options.wavefront) return RenderTileWavefront(camera, options, x0, y0, x1, y1, pixels);
+  if (options.adaptive) return RenderTileAdaptive(camera, options, x0, y0, x1, y1, pixels);
+  for (int y = y0; y < y1; ++y) {
+    if (options.simd) {
+      for (int x = x0; x < x1; x += 8)
+        RenderPacket(camera, options, x + 1, y + 1, min(8, x1 - x), pixels);
+    } else {
+      for (int x = x0; x < x1; ++x)
+        RenderPixel(camera, options, x + 1, y + 1, pixels);
+    }
+  }
+}
+
+// Even indices are scattered over the whole room, odd ones over the slab
+// around the letters where the culling decisions are close calls.
+Vec SelfTestPoint(unsigned int i) {
+  RandomKey key = {i, 0};
+  Vec u(randomVal(key, 0, 0), randomVal(key, 0, 1), randomVal(key, 0, 2));
+  return i % 2 ? Vec(-16 + 32 * u.x, -.5 + 11 * u.y, -3 + 6 * u.z)
+               : Vec(-30 + 60 * u.x, -.5 + 20.5 * u.y, -30 + 60 * u.z);
+}
+
+// Compares the compiled, culled QueryDatabase() against the original.
+bool SelfTestScene() {
+  int failures = 0, count = 8192;
+  for (int i = 0; i < count; ++i) {
+    Vec point = SelfTestPoint(i);
+    int hitType, referenceType;
+    float d = QueryDatabase(point, hitType);
+    float reference = QueryDatabaseReference(point, referenceType);
+    if (hitType != referenceType || fabsf(reference - d) > 1e-4 * (1 + fabsf(reference)))
+      ++failures;
+  }
+  printf("scene: QueryDatabase %d/%d points differ\n", failures, count);
+  return !failures;
+}
+
+// Measures the fast math kernels against libm in double precision and
+// checks the bounds documented with them.
+bool SelfTestFastMath() {
+  double rsqrtError = 0, rsqrt8Error = 0, sinCosError = 0, blendError = 0;
+  int plankFailures = 0, count = 1 << 16;
+  for (int i = 0; i < count; ++i) {
+    RandomKey key = {(unsigned int)i, 1};
+    float u = randomVal(key, 0, 0), v = randomVal(key, 0, 1);
+    float x = powf(10, 12 * u - 6); // 1e-6 to 1e6.
+    double exact = 1 / sqrt((double)x);
+    rsqrtError = fmax(rsqrtError, fabs(RSqrt(x) - exact) / exact);
+    for (PacketIsa &isa : PacketIsas()) {
+      if (!isa.supported) continue;
+      float lanes[8] = {x, x, x, x, x, x, x, x};
+      isa.rsqrt(lanes);
+      rsqrt8Error = fmax(rsqrt8Error, fabs(lanes[i & 7] - exact) / exact);
+    }
+
+    float s, c;
+    SinCos2Pi(u, s, c);
+    sinCosError = fmax(sinCosError, fmax(fabs(s - sin(6.283185307179586 * u)),
+                                         fabs(c - cos(6.283185307179586 * u))));
+
+    // Flat distances and depths the letters see: up to about 30 units.
+    float flat = 30 * u, z = 60 * v - 30;
+    double blend = pow(pow(flat, 8.) + pow(z, 8.), .125);
+    if (blend > 1e-3) blendError = fmax(blendError, fabs(Blend8(flat * flat, z) - blend) / blend);
+
+    float coordinate = 80 * u - 40;
+    plankFailures += Plank(coordinate) != fmodf(fabsf(coordinate), 8);
+  }
+  printf("fast math: RSqrt %.1e, packet rsqrt %.1e relative, SinCos2Pi %.1e absolute, "
+         "Blend8 %.1e relative, Plank %d/%d differ from fmodf\n",
+         rsqrtError, rsqrt8Error, sinCosError, blendError, plankFailures, count);
+  return rsqrtError < 3e-7 && rsqrt8Error < 3e-7 && sinCosError < 2e-7 && blendError < 3e-7
+         && !plankFailures;
+}
+
+// The contiguous range of tiles that part partIndex of partCount renders.
+void PartTiles(Camera &camera, Options &options, int &first, int &last) {
+  int tileCount = TileCount(camera);
+  first = (long long)tileCount * options.partIndex / options.partCount;
+  last = (long long)tileCount * (options.partIndex + 1) / options.partCount;
+}
+
+// Renders this part's tiles on threadCount threads. Finished tiles go to
+// the sink, or nowhere when they are accumulated instead.
+void RenderFrame(Camera &camera, Options &options, int threadCount, ImageSink* sink) {
+  int first, last;
+  PartTiles(camera, options, first, last);
+  if (threadCount > last - first) threadCount = last - first;
+  TileScheduler scheduler(last - first, threadCount);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threadCount; ++i)
+    workers.emplace_back([&, i] {
+      byte data[3 * TILE_SIZE * TILE_SIZE];
+      for (int tile; scheduler.next(i, tile);) {
+        Framebuffer pixels = TileRegion(camera, first + tile, data);
+        RenderTile(camera, options, first + tile, pixels);
+        if (sink) sink->write(pixels);
+      }
+      sunMap.addStats(sunMapStats);
+      brickMap.addStats(brickStats);
+      AddRayStats();
+    });
+  for (std::thread &worker : workers) worker.join();
+}
+
+// Resumes the accumulation in options.checkpoint, or starts it, and renders
+// passes of passSamples samples until every pixel has samplesCount. The
+// file is saved after each pass.
+bool RenderCheckpointed(Camera &camera, Options &options, int threadCount) {
+  if (!accumulation.load(options.checkpoint, camera.w, camera.h)) {
+    fprintf(stderr, "checkpoint: %s is not a %dx%d accumulation\n",
+            options.checkpoint, camera.w, camera.h);
+    return false;
+  }
+  // Pixels outside this part's tiles stay at zero.
+  unsigned int done = 0;
+  for (unsigned int samples : accumulation.samples) done = samples > done ? samples : done;
+  for (unsigned int samples : accumulation.samples)
+    if (samples && samples != done) {
+      fprintf(stderr, "checkpoint: %s has uneven sample counts\n", options.checkpoint);
+      return false;
+    }
+  if (done) fprintf(stderr, "checkpoint: resuming at %d samples\n", done);
+
+  Options pass = options;
+  while ((int)done < options.samplesCount) {
+    int remaining = options.samplesCount - done;
+    pass.samplesCount = remaining < options.passSamples ? remaining : options.passSamples;
+    firstSample = done;
+    RenderFrame(camera, pass, threadCount, NULL);
+    done += pass.samplesCount;
+    if (!accumulation.save(options.checkpoint)) {
+      fprintf(stderr, "checkpoint: cannot write %s\n", options.checkpoint);
+      return false;
+    }
+    fprintf(stderr, "checkpoint: %d/%d samples saved\n", done, options.samplesCount);
+  }
+  firstSample = 0;
+  return true;
+}
+
+// Fills the frame tile by tile with shade(pixel index, pixel) and writes it.
+template <class Shade>
+void WriteImage(Camera &camera, ImageSink &sink, Shade shade) {
+  int tileCount = TileCount(camera);
+  byte data[3 * TILE_SIZE * TILE_SIZE];
+  for (int tile = 0; tile < tileCount; ++tile) {
+    Framebuffer pixels = TileRegion(camera, tile, data);
+    for (int y = pixels.y0 + 1; y <= pixels.y0 + pixels.h; ++y)
+      for (int x = pixels.x0 + 1; x <= pixels.x0 + pixels.w; ++x)
+        shade(camera.w * (y - 1) + x - 1, pixels.at(x, y));
+    sink.write(pixels);
+  }
+}
+
+// The separate tone mapping pass over the accumulated sums.
+void WriteAccumulation(Camera &camera, ImageSink &sink) {
+  WriteImage(camera, sink, [](int index, byte pixel[]) {
+    ToneMap(accumulation.sums[index] * (1. / accumulation.samples[index]), pixel);
+  });
+}
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) over the
+// accumulated pixel means, before tone mapping. Level k is a 5x5 B3 spline
+// kernel with its taps 2^k pixels apart. Every tap is weighted down by how
+// far its normal, material, depth and color are from the center's, so the
+// blur stays within surfaces. Colors are compared after a Reinhard
+// squeeze, so the sunlit peaks do not dominate, and their tolerance halves
+// every level. Each level runs tile by tile on threadCount threads.
+std::vector<Vec> Denoise(Camera &camera, int levels, int threadCount) {
+  int w = camera.w, h = camera.h, size = w * h;
+  std::vector<Vec> colors(size), squeezed(size), normals(size), materials(size);
+  std::vector<float> depths(size);
+  for (int i = 0; i < size; ++i) {
+    Vec c = colors[i] = accumulation.sums[i] * (1. / accumulation.samples[i]);
+    squeezed[i] = Vec(c.x / (1 + c.x), c.y / (1 + c.y), c.z / (1 + c.z));
+    Vec m = features.materials[i], n = features.normals[i];
+    float count = m.x + m.y + m.z;
+    materials[i] = m * (1 / count);
+    depths[i] = features.depths[i] / count;
+    normals[i] = n % n > 0 ? !n : n;
+  }
+
+  float kernel[5] = {1. / 16, 1. / 4, 3. / 8, 1. / 4, 1. / 16};
+  int tileCount = TileCount(camera);
+  if (threadCount > tileCount) threadCount = tileCount;
+  std::vector<Vec> filtered(size);
+  for (int level = 0; level < levels; ++level) {
+    int step = 1 << level;
+    float colorPhi = 1.f / (1 << level);
+    TileScheduler scheduler(tileCount, threadCount);
+    std::vector<std::thread> workers;
+    for (int worker = 0; worker < threadCount; ++worker)
+      workers.emplace_back([&, worker] {
+        for (int tile; scheduler.next(worker, tile);) {
+          Framebuffer region = TileRegion(camera, tile, NULL);
+          for (int y = region.y0; y < region.y0 + region.h; ++y)
+            for (int x = region.x0; x < region.x0 + region.w; ++x) {
+              int p = w * y + x;
+              Vec sum, normal = normals[p];
+              float weights = 0, depthScale = .05f * step * (depths[p] + 1);
+              for (int j = 0; j < 5; ++j)
+                for (int i = 0; i < 5; ++i) {
+                  int qx = x + (i - 2) * step, qy = y + (j - 2) * step;
+                  if (qx < 0 || qx >= w || qy < 0 || qy >= h) continue;
+                  int q = w * qy + qx;
+                  Vec dc = squeezed[q] + squeezed[p] * -1, dm = materials[q] + materials[p] * -1;
+                  float cosine = normal % normals[q];
+                  float weight = kernel[i] * kernel[j]
+                                 * expf(-(dc % dc) / colorPhi - (dm % dm) * 8
+                                        - fabsf(depths[q] - depths[p]) / depthScale);
+                  if (normal % normal > 0) weight *= powf(cosine > 0 ? cosine : 0, 32);
+                  sum = sum + colors[q] * weight;
+                  weights += weight;
+                }
+              filtered[p] = sum * (1 / weights);
+            }
+        }
+      });
+    for (std::thread &worker : workers) worker.join();
+    colors.swap(filtered);
+    for (int i = 0; i < size; ++i) {
+      Vec c = colors[i];
+      squeezed[i] = Vec(c.x / (1 + c.x), c.y / (1 + c.y), c.z / (1 + c.z));
+    }
+  }
+  return colors;
+}
+
+// output with name inserted before its extension: card.bmp -> card.steps.bmp.
+std::string SiblingName(const char* output, const char* name) {
+  std::string path = output;
+  size_t dot = path.rfind('.'), slash = path.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+  return path.substr(0, dot) + "." + name + path.substr(dot);
+}
+
+// Appends the image to stdout as one binary PPM, for a viewer or an
+// "ffmpeg -f image2pipe" to pick up while the render goes on.
+template <class Shade>
+bool StreamFrame(Camera &camera, Shade shade) {
+  std::vector<byte> frame(3 * camera.w * camera.h);
+  byte* pixel = frame.data();
+  for (int y = camera.h; y >= 1; --y) // Same orientation as ImageSink.
+    for (int x = camera.w; x >= 1; --x, pixel += 3) shade(camera.w * (y - 1) + x - 1, pixel);
+  printf("P6 %d %d 255 ", camera.w, camera.h);
+  fwrite(frame.data(), 1, frame.size(), stdout);
+  return !fflush(stdout) && !ferror(stdout);
+}
+
+// Writes the accumulated image, denoised with --denoise: a frame on
+// stdout for "-", otherwise the output file, replaced by a rename so that
+// a viewer reloading it never sees half a frame.
+bool WriteFrame(Camera &camera, Options &options, int threadCount) {
+  std::vector<Vec> denoised;
+  if (options.denoise) denoised = Denoise(camera, options.denoise, threadCount);
+  auto shade = [&](int index, byte pixel[]) {
+    ToneMap(options.denoise ? denoised[index]
+                            : accumulation.sums[index] * (1. / accumulation.samples[index]),
+            pixel);
+  };
+  if (!strcmp(options.output, "-")) return StreamFrame(camera, shade);
+
+  std::string temporary = SiblingName(options.output, "tmp");
+  ImageSink sink;
+  if (!sink.open(temporary.c_str(), camera.w, camera.h)) return false;
+  WriteImage(camera, sink, shade);
+  bool ok = sink.close();
+  return ok && ReplaceFile(temporary.c_str(), options.output);
+}
+
+// Renders passes into the accumulation, each with as many samples per
+// pixel as all earlier ones together (1, 1, 2, 4, ...), and writes the
+// image after every pass, so the first one comes quickly and each later
+// one halves the variance. With a budget, every pass is cut down to what
+// still fits by the previous pass's time per sample, leaving room for a
+// write as long as the previous one, and rendering ends when not even one
+// sample does. -s caps the samples either way.
+bool RenderProgressive(Camera &camera, Options &options, int threadCount) {
+  accumulation.load(NULL, camera.w, camera.h);
+  if (options.denoise) features.reset(camera.w, camera.h);
+  auto start = std::chrono::steady_clock::now();
+  Options pass = options;
+  int done = 0;
+  double secondsPerSample = 0, writeSeconds = 0;
+  while (done < options.samplesCount) {
+    int remaining = options.samplesCount - done, samples = done ? done : 1;
+    if (samples > remaining) samples = remaining;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (options.budget > 0 && done) {
+      double fit = (options.budget - elapsed.count() - writeSeconds) / secondsPerSample;
+      if (fit < 1) break;
+      if (samples > fit) samples = fit;
+    }
+
+    auto passStart = std::chrono::steady_clock::now();
+    firstSample = done, pass.samplesCount = samples;
+    RenderFrame(camera, pass, threadCount, NULL);
+    std::chrono::duration<double> passTime = std::chrono::steady_clock::now() - passStart;
+    secondsPerSample = passTime.count() / samples;
+    done += samples;
+    auto writeStart = std::chrono::steady_clock::now();
+    if (!WriteFrame(camera, options, threadCount)) return false;
+    std::chrono::duration<double> writeTime = std::chrono::steady_clock::now() - writeStart;
+    writeSeconds = writeTime.count();
+    elapsed = std::chrono::steady_clock::now() - start;
+    fprintf(stderr, "progressive: %d samples per pixel after %.2f s\n", done, elapsed.count());
+  }
+  firstSample = 0;
+  return true;
+}
+
+#if defined(INSTRUMENT)
+// Black through red and yellow to white as t goes from 0 to 1.
+void HeatColor(float t, byte pixel[]) {
+  pixel[0] = (byte)(255 * fminf(1, 3 * t));
+  pixel[1] = (byte)(255 * fminf(1, fmaxf(0, 3 * t - 1)));
+  pixel[2] = (byte)(255 * fmaxf(0, 3 * t - 2));
+}
+
+// Writes one heatmap per counter, scaled to the frame's costliest pixel,
+// plus a hit-type image with letters in red, walls in green and sun in
+// blue, and prints the per-sample averages.
+bool WriteHeatmaps(Camera &camera, Options &options) {
+  const char* names[4] = {"steps", "queries", "bounces", "shadows"};
+  auto perSample = [](PixelCost &cost, int counter) {
+    long long counts[4] = {cost.steps, cost.queries, cost.bounces, cost.shadowRays};
+    return cost.samples ? (float)counts[counter] / cost.samples : 0.f;
+  };
+  PixelCost total;
+  for (PixelCost &cost : pixelCosts) {
+    total.samples += cost.samples, total.steps += cost.steps, total.queries += cost.queries;
+    total.bounces += cost.bounces, total.shadowRays += cost.shadowRays;
+    for (int i = 0; i < 4; ++i) total.hits[i] += cost.hits[i];
+  }
+
+  bool ok = true;
+  fprintf(stderr, "%-10s %12s %12s\n", "per sample", "mean", "max pixel");
+  for (int counter = 0; counter < 4; ++counter) {
+    float highest = 0;
+    for (PixelCost &cost : pixelCosts) highest = fmaxf(highest, perSample(cost, counter));
+    fprintf(stderr, "%-10s %12.2f %12.2f\n", names[counter], perSample(total, counter), highest);
+    ImageSink sink;
+    ok = sink.open(SiblingName(options.output, names[counter]).c_str(), camera.w, camera.h) && ok;
+    if (!sink.file) continue;
+    WriteImage(camera, sink, [&](int index, byte pixel[]) {
+      HeatColor(highest ? perSample(pixelCosts[index], counter) / highest : 0, pixel);
+    });
+    ok = sink.close() && ok;
+  }
+
+  const char* hitNames[4] = {"none", "letter", "wall", "sun"};
+  for (int i = 0; i < 4; ++i)
+    fprintf(stderr, "hits %-6s %10.1f%%\n", hitNames[i], 100. * total.hits[i] / total.bounces);
+  ImageSink sink;
+  if (!sink.open(SiblingName(options.output, "hits").c_str(), camera.w, camera.h)) return false;
+  WriteImage(camera, sink, [&](int index, byte pixel[]) {
+    PixelCost &cost = pixelCosts[index];
+    for (int i = 0; i < 3; ++i)
+      pixel[i] = cost.bounces ? (byte)(255 * cost.hits[HIT_LETTER + i] / cost.bounces) : 0;
+  });
+  return sink.close() && ok;
+}
+#endif
+
+// Compares the rendered output with a golden image by per-channel RMSE
+// and PSNR, of psnrBlock-wide block means when set. Below minPsnr it writes
+// the absolute difference, scaled by 8, next to the output and fails.
+bool CompareImages(Camera &camera, Options &options) {
+  int w, h, goldenW, goldenH;
+  std::vector<byte> image, golden;
+  if (!ReadImage(options.output, w, h, image)) {
+    fprintf(stderr, "compare: cannot read %s\n", options.output);
+    return false;
+  }
+  if (!ReadImage(options.compare, goldenW, goldenH, golden) || goldenW != w || goldenH != h) {
+    fprintf(stderr, "compare: %s is not a readable %dx%d image\n", options.compare, w, h);
+    return false;
+  }
+  const char* channels[3] = {"red", "green", "blue"};
+  bool passed = true;
+  int block = options.psnrBlock, blocksX = w / block, blocksY = h / block;
+  for (int i = 0; i < 3; ++i) {
+    double squares = 0;
+    for (int by = 0; by < blocksY; ++by)
+      for (int bx = 0; bx < blocksX; ++bx) {
+        double difference = 0;
+        for (int y = by * block; y < (by + 1) * block; ++y)
+          for (int x = bx * block; x < (bx + 1) * block; ++x)
+            difference += image[3 * (w * y + x) + i] - golden[3 * (w * y + x) + i];
+        difference /= block * block;
+        squares += difference * difference;
+      }
+    double mse = squares / (blocksX * blocksY), psnr = mse ? 10 * log10(255 * 255 / mse) : INFINITY;
+    printf("compare: %-5s RMSE %7.3f PSNR %6.2f dB\n", channels[i], sqrt(mse), psnr);
+    passed &= psnr >= options.minPsnr;
+  }
+  if (passed) return true;
+
+  std::string name = SiblingName(options.output, "diff");
+  fprintf(stderr, "compare: below %.1f dB against %s, difference in %s\n",
+          options.minPsnr, options.compare, name.c_str());
+  ImageSink sink;
+  if (!sink.open(name.c_str(), w, h)) return false;
+  WriteImage(camera, sink, [&](int index, byte pixel[]) {
+    for (int i = 0; i < 3; ++i) {
+      int difference = 8 * abs(image[3 * index + i] - golden[3 * index + i]);
+      pixel[i] = difference > 255 ? 255 : difference;
+    }
+  });
+  sink.close();
+  return false;
+}
+
+// Sums the partial accumulations written by --part runs and writes the
+// image. Every pixel must have been rendered by some part.
+bool MergeParts(Camera &camera, Options &options) {
+  Accumulation part;
+  accumulation.load(NULL, camera.w, camera.h);
+  for (const char* name : options.mergeInputs) {
+    FILE* file = fopen(name, "rb"); // load() would take a missing file as empty.
+    bool exists = file != NULL;
+    if (exists) fclose(file);
+    if (!exists || !part.load(name, camera.w, camera.h)) {
+      fprintf(stderr, "merge: %s is not a %dx%d accumulation\n", name, camera.w, camera.h);
+      return false;
+    }
+    accumulation.add(part);
+  }
+  int missing = 0;
+  for (unsigned int samples : accumulation.samples) missing += !samples;
+  if (missing) {
+    fprintf(stderr, "merge: %d pixels are in none of the parts\n", missing);
+    return false;
+  }
+  ImageSink sink;
+  if (!sink.open(options.output, camera.w, camera.h)) {
+    fprintf(stderr, "cannot write %s\n", options.output);
+    return false;
+  }
+  WriteAccumulation(camera, sink);
+  return sink.close();
+}
+
+// Renders the frame once per marching strategy on the calling thread and
+// prints how many steps each RayMarching() call took.
+void StepHistogram(Camera &camera, Options &options) {
+  const char* names[2] = {"classic", "relaxed"};
+  static long long histograms[2][MAX_HISTOGRAM_STEPS];
+  double seconds[2];
+  Framebuffer pixels = {new byte[3 * camera.w * camera.h], 0, 0, camera.w, camera.h};
+  int tileCount = TileCount(camera);
+  for (int strategy = 0; strategy < 2; ++strategy) {
+    marchStrategy = strategy;
+    stepHistogram = histograms[strategy];
+    auto start = std::chrono::steady_clock::now();
+    for (int tile = 0; tile < tileCount; ++tile) RenderTile(camera, options, tile, pixels);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    seconds[strategy] = elapsed.count();
+  }
+  stepHistogram = NULL;
+  delete[] pixels.data;
+
+  long long rays[2] = {0, 0}, steps[2] = {0, 0};
+  printf("%-10s %12s %12s\n", "steps", names[0], names[1]);
+  for (int bin = 0; bin < MAX_HISTOGRAM_STEPS; bin += 8) {
+    long long counts[2] = {0, 0};
+    for (int strategy = 0; strategy < 2; ++strategy)
+      for (int i = bin; i < bin + 8; ++i) {
+        counts[strategy] += histograms[strategy][i];
+        steps[strategy] += histograms[strategy][i] * i;
+      }
+    rays[0] += counts[0], rays[1] += counts[1];
+    if (counts[0] || counts[1]) printf("%3d-%-6d %12lld %12lld\n", bin, bin + 7, counts[0], counts[1]);
+  }
+  printf("%-10s %12lld %12lld\n", "rays", rays[0], rays[1]);
+  printf("%-10s %12.2f %12.2f\n", "mean", (double)steps[0] / rays[0], (double)steps[1] / rays[1]);
+  printf("%-10s %12lld %12lld\n", "total", steps[0], steps[1]);
+  printf("%-10s %12.2f %12.2f\n", "seconds", seconds[0], seconds[1]);
+}
+
+// Compares analytic normals with the finite-difference ones at the first hit
+// of every primary ray. Forward differences step .01 across kinks such as
+// box edges and glyph joints, so a few hits may disagree, but the bulk must
+// match closely.
+bool SelfTestGradient(Camera &camera) {
+  int count = 0, off = 0;
+  double totalAngle = 0;
+  bool mode = finiteDifferenceNormals;
+  finiteDifferenceNormals = true;
+  for (int y = 1; y <= camera.h; ++y)
+    for (int x = 1; x <= camera.w; ++x) {
+      Vec position, reference, gradient;
+      if (!RayMarching(camera.position, PrimaryDirection(camera, x, y, PixelKey(camera, x, y, 0)),
+                       position, reference))
+        continue;
+      int hitType;
+      QueryDatabase(position, hitType, gradient);
+      float angle = acosf(fminf(!gradient % reference, 1)) * 57.29578f;
+      totalAngle += angle, ++count;
+      if (angle > 5) ++off;
+    }
+  finiteDifferenceNormals = mode;
+  printf("gradient: mean %.3f degrees from finite differences, %d/%d hits over 5 degrees\n",
+         totalAngle / count, off, count);
+  return off * 100 <= count;
+}
+
+// Checks that the prepass distance never passes the first hit of a primary
+// ray, and that rays started there hit the same surfaces at the same
+// distances. A ray that grazes a surface within the .01 hit threshold counts
+// as a hit only if one of its steps lands in that sliver, so a handful of
+// grazing rays may legitimately change their hit when started elsewhere.
+bool SelfTestPrepass(Camera &camera) {
+  DepthPrepass prepass;
+  prepass.build(camera);
+  int beyond = 0, differ = 0, count = 0;
+  for (int y = 1; y <= camera.h; ++y)
+    for (int x = 1; x <= camera.w; ++x)
+      for (int p = 0; p < 4; ++p, ++count) {
+        Vec direction = PrimaryDirection(camera, x, y, PixelKey(camera, x, y, p));
+        Vec position, reference, normal;
+        float start = prepass.startDistance(x, y);
+        int hitType = RayMarching(camera.position + direction * start, direction, position, normal);
+        int referenceType = RayMarching(camera.position, direction, reference, normal);
+        Vec a = position + camera.position * -1, b = reference + camera.position * -1;
+        if (start > sqrtf(b % b)) ++beyond;
+        else if (hitType != referenceType || fabsf(sqrtf(a % a) - sqrtf(b % b)) > 2e-2) ++differ;
+      }
+  printf("prepass: %d/%d starts beyond the first hit, %d/%d primary rays differ\n",
+         beyond, count, differ, count);
+  return !beyond && differ * 1000 <= count;
+}
+
+// No brick bound may exceed the exact distance at a point of its brick,
+// and primary rays must hit the same surfaces with and without the map.
+bool SelfTestBrickMap(Camera &camera) {
+  std::vector<Hit> hits;
+  for (int y = 1; y <= camera.h; ++y)
+    for (int x = 1; x <= camera.w; ++x) {
+      Hit hit;
+      Vec direction = PrimaryDirection(camera, x, y, PixelKey(camera, x, y, 0));
+      hit.type = RayMarching(camera.position, direction, hit.position, hit.normal);
+      hits.push_back(hit);
+    }
+  brickMap.build(256 << 10);
+  int above = 0, differ = 0, count = 8192;
+  for (int i = 0; i < count; ++i) {
+    int hitType;
+    Vec point = SelfTestPoint(i);
+    float bound = brickMap.bound(point);
+    above += bound > 0 && bound > QueryDatabase(point, hitType);
+  }
+  for (Hit &reference : hits) {
+    int i = &reference - hits.data(), x = i % camera.w + 1, y = i / camera.w + 1;
+    Hit hit;
+    Vec direction = PrimaryDirection(camera, x, y, PixelKey(camera, x, y, 0));
+    hit.type = RayMarching(camera.position, direction, hit.position, hit.normal);
+    Vec a = hit.position + camera.position * -1, b = reference.position + camera.position * -1;
+    differ += hit.type != reference.type || fabsf(sqrtf(a % a) - sqrtf(b % b)) > 2e-2;
+  }
+  brickMap.bounds.clear(); // Back off for the checks that follow.
+  brickStats = BrickStats();
+  printf("brick map: %d/%d bounds above the exact distance, %d/%d primary rays differ\n",
+         above, count, differ, (int)hits.size());
+  return !above && differ * 1000 <= (int)hits.size();
+}
+
+// Answers the shadow rays of first and second wall hits from the map and
+// by marching. Those the map answers must agree with the march.
+bool SelfTestSunMap(Camera &camera) {
+  sunMap.build(512);
+  Vec light = sunMap.light;
+  int wrong = 0, answered = 0, count = 0;
+  for (int y = 1; y <= camera.h; ++y)
+    for (int x = 1; x <= camera.w; ++x) {
+      RandomKey key = PixelKey(camera, x, y, 0);
+      Vec origin = camera.position, direction = PrimaryDirection(camera, x, y, key);
+      for (int bounce = 1; bounce <= 2; ++bounce) {
+        Vec position, normal, p, n;
+        if (RayMarching(origin, direction, position, normal) != HIT_WALL) break;
+        if (normal % light > 0) {
+          Vec shadowOrigin = position + normal * .1;
+          int hitType = sunMap.lookup(shadowOrigin), reference = RayMarching(shadowOrigin, light, p, n);
+          ++count;
+          if (hitType >= 0) ++answered, wrong += (hitType == HIT_SUN) != (reference == HIT_SUN);
+        }
+        direction = DiffuseDirection(normal, key, bounce);
+        origin = position + direction * .1;
+      }
+    }
+  sunMap.size = 0; // Back off for the checks that follow.
+  sunMapStats = SunMapStats();
+  printf("sun map: %d/%d shadow rays answered, %d of them wrongly\n", answered, count, wrong);
+  return wrong * 1000 <= count;
+}
+
+// Renders a few tiles with both engines; without --simd they must match
+// byte for byte.
+bool SelfTestWavefront(Camera &camera, Options &options) {
+  Options test = options;
+  test.samplesCount = 2, test.simd = false;
+  int tiles = 6, failures[2] = {};
+  Framebuffer pixels[2];
+  for (int sampling = 0; sampling < 2; ++sampling) {
+    // Plain sampling, then roulette and MIS over paths long enough for both.
+    russianRoulette = skyMis = sampling, maxDepth = sampling ? 8 : options.maxDepth;
+    for (int engine = 0; engine < 2; ++engine) {
+      pixels[engine] = {new byte[3 * camera.w * camera.h](), 0, 0, camera.w, camera.h};
+      test.wavefront = engine;
+      for (int tile = 0; tile < tiles; ++tile) RenderTile(camera, test, tile, pixels[engine]);
+    }
+    for (int i = 0; i < 3 * camera.w * camera.h; ++i)
+      failures[sampling] += pixels[0].data[i] != pixels[1].data[i];
+    delete[] pixels[0].data;
+    delete[] pixels[1].data;
+  }
+  russianRoulette = options.roulette, skyMis = options.mis, maxDepth = options.maxDepth;
+  printf("wavefront: %d bytes differ from the megakernel over %d tiles, %d with roulette and MIS\n",
+         failures[0], tiles, failures[1]);
+  return !failures[0] && !failures[1];
+}
+
+// Streams a patterned frame with a padded BMP row in reverse tile order
+// and reads both formats back.
+bool SelfTestSink() {
+  Camera camera;
+  camera.w = 2 * TILE_SIZE + 5, camera.h = TILE_SIZE + 5;
+  int tiles = 3 * 2, failures = 0;
+  const char* names[2] = {"selftest.bmp", "selftest.ppm"};
+  for (int format = 0; format < 2; ++format) {
+    ImageSink sink;
+    if (!sink.open(names[format], camera.w, camera.h)) return false;
+    byte data[3 * TILE_SIZE * TILE_SIZE];
+    for (int tile = tiles; tile--;) {
+      Framebuffer pixels = TileRegion(camera, tile, data);
+      for (int y = pixels.y0 + 1; y <= pixels.y0 + pixels.h; ++y)
+        for (int x = pixels.x0 + 1; x <= pixels.x0 + pixels.w; ++x)
+          for (int c = 0; c < 3; ++c) pixels.at(x, y)[c] = (byte)(x * 7 + y * 3 + c * 100);
+      sink.write(pixels);
+    }
+    if (!sink.close()) return false;
+
+    FILE* file = fopen(names[format], "rb");
+    std::vector<byte> bytes(sink.headerBytes + (size_t)sink.rowBytes * camera.h + 1);
+    size_t size = fread(bytes.data(), 1, bytes.size(), file);
+    fclose(file);
+    remove(names[format]);
+    failures += size != bytes.size() - 1;
+    for (int y = 1; y <= camera.h && size == bytes.size() - 1; ++y)
+      for (int x = 1; x <= camera.w; ++x)
+        for (int c = 0; c < 3; ++c) {
+          int row = format ? camera.h - y : y - 1, channel = format ? c : 2 - c;
+          byte stored = bytes[sink.headerBytes + row * sink.rowBytes + 3 * (camera.w - x) + channel];
+          failures += stored != (byte)(x * 7 + y * 3 + c * 100);
+        }
+  }
+  printf("sink: %d bytes differ after streaming BMP and PPM tiles out of order\n", failures);
+  return !failures;
+}
+
+// Accumulates the first tiles in one pass of two samples, then again in two
+// passes of one sample with a save and load in between. Both must tone map
+// to the same bytes.
+bool SelfTestCheckpoint(Camera &camera, Options &options) {
+  Options test = options;
+  test.simd = test.wavefront = test.adaptive = false;
+  const char* name = "selftest.acc";
+  int tiles = 6, failures = 0;
+  auto renderPass = [&](int first, int samplesCount) {
+    byte data[3 * TILE_SIZE * TILE_SIZE];
+    firstSample = first, test.samplesCount = samplesCount;
+    for (int tile = 0; tile < tiles; ++tile) {
+      Framebuffer pixels = TileRegion(camera, tile, data);
+      RenderTile(camera, test, tile, pixels);
+    }
+    firstSample = 0;
+  };
+
+  remove(name);
+  accumulation.load(name, camera.w, camera.h);
+  renderPass(0, 2);
+  Accumulation straight = accumulation;
+  accumulation.load(name, camera.w, camera.h);
+  renderPass(0, 1);
+  bool saved = accumulation.save(name) && accumulation.load(name, camera.w, camera.h);
+  renderPass(1, 1);
+  remove(name);
+
+  byte bytes[2][3];
+  for (size_t i = 0; i < straight.sums.size(); ++i) {
+    if (!straight.samples[i]) continue;
+    ToneMap(straight.sums[i] * (1. / straight.samples[i]), bytes[0]);
+    ToneMap(accumulation.sums[i] * (1. / accumulation.samples[i]), bytes[1]);
+    failures += straight.samples[i] != accumulation.samples[i] || memcmp(bytes[0], bytes[1], 3);
+  }
+  accumulation = Accumulation();
+  printf("checkpoint: %d pixels differ after a save and resume\n", failures);
+  return saved && !failures;
+}
+
+// Roulette and MIS change the noise but must not change the expected
+// image: the mean radiance over the frame has to stay within 5% of plain
+// sampling, which with these sample counts is several standard deviations.
+bool SelfTestSampling(Camera &camera, Options &options) {
+  Options test = options;
+  test.samplesCount = 4, test.simd = test.wavefront = test.adaptive = false;
+  int tileCount = TileCount(camera);
+  byte data[3 * TILE_SIZE * TILE_SIZE];
+  Vec means[4];
+  for (int mode = 0; mode < 4; ++mode) {
+    russianRoulette = mode & 1, skyMis = mode & 2;
+    accumulation.load(NULL, camera.w, camera.h);
+    for (int tile = 0; tile < tileCount; ++tile) {
+      Framebuffer pixels = TileRegion(camera, tile, data);
+      RenderTile(camera, test, tile, pixels);
+    }
+    for (Vec sum : accumulation.sums) means[mode] = means[mode] + sum;
+  }
+  russianRoulette = options.roulette, skyMis = options.mis;
+  accumulation = Accumulation();
+  float worst = 0;
+  for (int mode = 1; mode < 4; ++mode) {
+    Vec ratio(means[mode].x / means[0].x, means[mode].y / means[0].y, means[mode].z / means[0].z);
+    worst = fmaxf(worst, fmaxf(fabsf(ratio.x - 1), fmaxf(fabsf(ratio.y - 1), fabsf(ratio.z - 1))));
+  }
+  printf("sampling: roulette and MIS means within %.1f%% of plain sampling\n", 100 * worst);
+  return worst < .05;
+}
+
+// The built-in scene description, compiled, must evaluate to what
+// QueryDatabase() does. Its parse errors must point at the right line.
+bool SelfTestSceneProgram() {
+  std::vector<Instruction> program, broken;
+  if (!CompileSceneText(builtinScene, "builtin", program)) return false;
+  int failures = 0, count = 8192;
+  for (int i = 0; i < count; ++i) {
+    Vec point = SelfTestPoint(i);
+    int hitType, referenceType;
+    float d = RunScene(program, point, hitType);
+    float reference = QueryDatabase(point, referenceType);
+    if (hitType != referenceType || fabsf(reference - d) > 1e-4 * (1 + fabsf(reference)))
+      ++failures;
+  }
+  printf("scene program: %d instructions, %d/%d points differ\n",
+         (int)program.size(), failures, count);
+  std::string error;
+  bool rejected = !CompileSceneText("(sun (above-y 19.9))\n(wall (box 1 2 3))", "broken", broken,
+                                    &error);
+  printf("scene program: a box of three numbers %s\n", rejected ? "is rejected" : "compiles");
+  // More domains than SCENE_STACK, and more parentheses than SCENE_NESTING.
+  const char* domains[2] = {"repeat-x 8", "translate 1 0 0"};
+  int depths[2] = {40, 100};
+  for (int i = 0; i < 2; ++i) {
+    std::string nested = "(box 0 0 0 1 1 1)";
+    for (int level = 0; level < depths[i]; ++level)
+      nested = std::string("(") + domains[i] + " " + nested + ")";
+    bool deep = !CompileSceneText("(wall " + nested + ")", "deep", broken, &error)
+                && error == "nested too deeply";
+    printf("scene program: %d deep (%s ...) %s\n", depths[i], domains[i],
+           deep ? "is rejected" : "is not rejected as too deep");
+    rejected = deep && rejected;
+  }
+  return rejected && !failures;
+}
+
+// The feature buffers must agree between the engines. Then a synthetic
+// frame, a noisy bright wall on the left and a noisy dark letter on the
+// right, must come out of the denoiser far smoother without either half
+// bleeding into the other.
+bool SelfTestDenoise(Camera &camera, Options &options) {
+  Options test = options;
+  test.samplesCount = 2, test.adaptive = false;
+  int tiles = 6, failures = 0;
+  byte data[3 * TILE_SIZE * TILE_SIZE];
+  std::vector<Vec> materials[3];
+  std::vector<float> depths[3];
+  accumulation.load(NULL, camera.w, camera.h);
+  int engines = packetIsa ? 3 : 2;
+  for (int engine = 0; engine < engines; ++engine) {
+    test.wavefront = engine == 1, test.simd = engine == 2;
+    features.reset(camera.w, camera.h);
+    for (int tile = 0; tile < tiles; ++tile) {
+      Framebuffer pixels = TileRegion(camera, tile, data);
+      RenderTile(camera, test, tile, pixels);
+    }
+    materials[engine] = features.materials, depths[engine] = features.depths;
+  }
+  for (int engine = 1; engine < engines; ++engine)
+    for (size_t i = 0; i < depths[0].size(); ++i) {
+      Vec m = materials[engine][i] + materials[0][i] * -1;
+      failures += m % m > 0 || fabsf(depths[engine][i] - depths[0][i]) > 2e-2;
+    }
+  printf("denoise: %d feature pixels differ between the engines\n", failures);
+
+  Camera frame = MakeCamera(64, 32);
+  accumulation.load(NULL, frame.w, frame.h);
+  features.reset(frame.w, frame.h);
+  for (int y = 1; y <= frame.h; ++y)
+    for (int x = 1; x <= frame.w; ++x) {
+      RandomKey key = {(unsigned int)(frame.w * (y - 1) + x - 1), 0};
+      bool wall = x <= frame.w / 2;
+      Hit hit = {wall ? HIT_WALL : HIT_LETTER, Vec(x, y, 10), wall ? Vec(0, 0, 1) : Vec(1, 0, 0)};
+      accumulation.add(x, y, Vec(1) * ((wall ? 1 : .1) * (.5 + randomVal(key, 0, 0))), 1);
+      features.add(x, y, Vec(x, y, 0), hit);
+    }
+  std::vector<Vec> denoised = Denoise(frame, 5, 1);
+  double noise[2] = {}, filteredNoise[2] = {}, bleed = 0;
+  for (int x = 1; x <= frame.w; ++x) {
+    int half = x > frame.w / 2;
+    double base = half ? .1 : 1, column = 0;
+    for (int y = 1; y <= frame.h; ++y) {
+      int i = frame.w * (y - 1) + x - 1;
+      double before = accumulation.sums[i].x - base, after = denoised[i].x - base;
+      noise[half] += before * before, filteredNoise[half] += after * after;
+      column += denoised[i].x / frame.h;
+    }
+    bleed = fmax(bleed, fabs(column - base) / base);
+  }
+  features = FeatureBuffers();
+  accumulation = Accumulation();
+  double reduction = fmin(sqrt(noise[0] / filteredNoise[0]), sqrt(noise[1] / filteredNoise[1]));
+  printf("denoise: noise down %.1fx, columns within %.1f%% of their half's level\n",
+         reduction, 100 * bleed);
+  return !failures && reduction > 4 && bleed < .05;
+}
+
+// Compares the packet SDF and marcher against the scalar path: distances at
+// scattered points, then hit types and hit distances for every primary ray
+// of the frame.
+bool SelfTestSimd(Camera &camera, PacketIsa &isa) {
+  int failures = 0, count = 0;
+  for (unsigned int i = 0; i < 8192; i += 8) {
+    Vec points[8];
+    float d[8], types[8];
+    for (int j = 0; j < 8; ++j) points[j] = SelfTestPoint(i + j);
+    isa.query(points, d, types);
+    for (int j = 0; j < 8; ++j, ++count) {
+      int hitType;
+      float reference = QueryDatabase(points[j], hitType);
+      if (hitType != (int)types[j] || fabsf(reference - d[j]) > 1e-4 * (1 + fabsf(reference)))
+        ++failures;
+    }
+  }
+  printf("simd %s: QueryDatabase8 %d/%d points differ\n", isa.name, failures, count);
+  bool ok = !failures;
+
+  failures = 0, count = 0;
+  for (int y = 1; y <= camera.h; ++y)
+    for (int x = 1; x <= camera.w; x += 8) {
+      Vec origins[8], directions[8];
+      Hit hits[8];
+      for (int i = 0; i < 8; ++i) {
+        origins[i] = camera.position;
+        directions[i] = PrimaryDirection(camera, x + i, y, PixelKey(camera, x + i, y, 0));
+      }
+      isa.march(origins, directions, 255, hits);
+      for (int i = 0; i < 8 && x + i <= camera.w; ++i, ++count) {
+        Vec position, normal;
+        int hitType = RayMarching(camera.position, directions[i], position, normal);
+        Vec a = position + camera.position * -1, b = hits[i].position + camera.position * -1;
+        if (hitType != hits[i].type || fabsf(sqrtf(a % a) - sqrtf(b % b)) > 1e-2)
+          ++failures;
+      }
+    }
+  printf("simd %s: RayMarching8 %d/%d primary rays differ\n", isa.name, failures, count);
+  return ok && !failures;
+}
+
+// Renders fixed configurations of the card with the other options as given
+// and prints their timings and work counters as JSON. The sampling is
+// seeded by pixel and sample number, so every run traces the same rays.
+void Bench(Options &options, int threadCount) {
+  int configs[][3] = {{160, 90, 8}, {320, 180, 8}, {320, 180, 32}};
+  Options run = options;
+  run.adaptive = false, run.checkpoint = NULL, run.partIndex = 0, run.partCount = 1;
+  printf("{\n  \"compiler\": \"%s\",\n  \"isa\": \"%s\",\n  \"threads\": %d,\n",
+         __VERSION__, packetIsa ? packetIsa->name : "none", threadCount);
+  printf("  \"options\": {\"simd\": %s, \"engine\": \"%s\", \"marcher\": \"%s\", "
+         "\"prepass\": %s, \"fd_normals\": %s, "
+         "\"max_depth\": %d, \"roulette\": %s, \"mis\": %s, \"sun_map\": %d, "
+         "\"brick_map\": %d},\n",
+         run.simd ? "true" : "false", run.wavefront ? "wavefront" : "megakernel",
+         run.marchStrategy == MARCH_RELAXED ? "relaxed" : "classic",
+         run.prepass ? "true" : "false",
+         run.finiteDifferenceNormals ? "true" : "false", run.maxDepth,
+         run.roulette ? "true" : "false", run.mis ? "true" : "false", run.sunMapSize,
+         run.brickMapKb);
+  printf("  \"scene\": \"%s\",\n",
+         options.scene ? options.scene : options.interpret ? "interpreted" : "builtin");
+
+  // Distance queries at the self test points, the hand-written
+  // QueryDatabase() against the built-in scene program.
+  std::vector<Instruction> builtin;
+  CompileSceneText(builtinScene, "builtin", builtin);
+  std::vector<Instruction> program;
+  program.swap(sceneProgram);
+  RayStats counted = rayStats;
+  double nanoseconds[2];
+  float sink = 0;
+  int points = 1 << 16;
+  std::vector<Vec> positions;
+  for (int i = 0; i < points; ++i) positions.push_back(SelfTestPoint(i));
+  for (int interpreted = 0; interpreted < 2; ++interpreted) {
+    auto start = std::chrono::steady_clock::now();
+    for (Vec &position : positions) {
+      int hitType;
+      sink += interpreted ? RunScene(builtin, position, hitType) : QueryDatabase(position, hitType);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    nanoseconds[interpreted] = elapsed.count() * 1e9 / points;
+  }
+  program.swap(sceneProgram);
+  rayStats = counted; // These queries are not part of the renders.
+  printf("  \"sdf\": {\"points\": %d, \"native_ns\": %.1f, \"bytecode_ns\": %.1f, "
+         "\"instructions\": %d, \"checksum\": %.0f},\n",
+         points, nanoseconds[0], nanoseconds[1], (int)builtin.size(), sink);
+  printf("  \"runs\": [\n");
+  int count = sizeof(configs) / sizeof(configs[0]);
+  for (int i = 0; i < count; ++i) {
+    run.w = configs[i][0], run.h = configs[i][1], run.samplesCount = configs[i][2];
+    Camera camera = MakeCamera(run.w, run.h);
+    pixelFootprint = camera.footprint;
+    if (run.prepass) depthPrepass.build(camera);
+    rayTotals = RayStats();
+    auto start = std::chrono::steady_clock::now();
+    RenderFrame(camera, run, threadCount, NULL);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Every sample marches exactly one primary ray.
+    double seconds = elapsed.count(), rays = rayTotals.rays;
+    double primary = (double)run.w * run.h * run.samplesCount, secondary = rays - primary;
+    printf("    {\"width\": %d, \"height\": %d, \"samples\": %d, \"seconds\": %.4f, "
+           "\"primary_rays\": %.0f, \"secondary_rays\": %.0f, "
+           "\"primary_rays_per_second\": %.0f, \"secondary_rays_per_second\": %.0f, "
+           "\"queries_per_ray\": %.3f, \"steps_per_ray\": %.3f}%s\n",
+           run.w, run.h, run.samplesCount, seconds, primary, secondary,
+           primary / seconds, secondary / seconds, rayTotals.queries / rays,
+           rayTotals.steps / rays, i + 1 < count ? "," : "");
+    fflush(stdout);
+  }
+  printf("  ]\n}\n");
+}
+
+void PrintUsage() {
+  fprintf(stderr,
+          "Usage: PathTracerCpp [options]\n"
+          "  -w, --width N     image width (240)\n"
+          "  -h, --height N    image height (135)\n"
+          "  -s, --samples N   samples per pixel (24)\n"
+          "  -t, --threads N   worker threads, 0 = all cores (0)\n"
+          "  -o, --output F    output file, PPM if it ends in .ppm, - for PPM on\n"
+          "                    stdout, a frame per --progressive pass (cardCPP.bmp)\n"
+          "      --simd        march primary rays in packets of eight (x86 only)\n"
+          "      --isa I       packet instruction set: avx2, avx512, sse4 or sse2\n"
+          "                    (the first of these this CPU supports)\n"
+          "      --fd-normals  finite-difference normals instead of analytic ones\n"
+          "      --marcher M   classic or relaxed sphere tracing (classic)\n"
+          "      --prepass     start primary rays at a cone-marched safe distance\n"
+          "      --sun-map N   answer sun shadow rays from an N x N visibility map\n"
+          "                    over the sky, 0 = off (0; 512 is good)\n"
+          "      --brick-map KB    skip empty space with a brick map of at most KB\n"
+          "                    kilobytes, classic marcher only, 0 = off (0; 256 is good)\n"
+          "      --engine E    megakernel or wavefront (megakernel)\n"
+          "      --adaptive    sample each pixel until it converges, with the\n"
+          "                    megakernel and without packets\n"
+          "      --min-samples N   adaptive samples before the first check (16)\n"
+          "      --max-samples N   adaptive sample limit (256)\n"
+          "      --tolerance T     adaptive 95%% interval target in 8-bit levels (160)\n"
+          "      --max-depth N bounces per path (3)\n"
+          "      --roulette    end paths by Russian roulette on their throughput\n"
+          "      --mis         also sample the sky at wall hits, with multiple\n"
+          "                    importance sampling\n"
+          "      --denoise N   filter N edge-aware a-trous levels over the frame,\n"
+          "                    guided by first-hit features, 0 = off (0; 5 is good)\n"
+          "      --progressive render passes of 1, 1, 2, 4... samples per pixel up\n"
+          "                    to -s and write the image after each\n"
+          "      --budget S    end the progressive passes within S seconds\n"
+          "                    (implies --progressive)\n"
+          "      --checkpoint F    accumulate in F, resuming it if it exists, until\n"
+          "                        every pixel has -s samples\n"
+          "      --pass-samples N  samples per pixel between checkpoints (8)\n"
+          "      --part K/N    render only tile range K of N (from 0) into --checkpoint\n"
+          "      --merge F...  sum the --part checkpoints F... and write the image\n"
+          "      --step-histogram  compare march step counts of both marchers\n"
+          "      --bench       time fixed renders and print JSON to stdout\n"
+          "      --compare F   check the output against golden image F, writing a\n"
+          "                    difference image and exiting with 2 when it diverges\n"
+          "      --min-psnr DB     lowest per-channel PSNR that passes (40)\n"
+          "      --psnr-block N    take the PSNR of N x N block means, which keeps\n"
+          "                        bias and averages noise away (1)\n"
+          "      --heatmaps    write per-pixel cost images next to the output\n"
+          "                    (builds with -DINSTRUMENT, megakernel without packets)\n"
+          "      --selftest    check the optimized paths against the reference\n"
+          "      --scene F     render scene file F instead of the card (not with\n"
+          "                    --simd, --mis or --sun-map)\n"
+          "      --interpret   render the card through the scene interpreter\n");
+}
+
+bool ParseOptions(int argc, char** argv, Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+#define OPTION(shortName, longName) \
+    ((!strcmp(arg, shortName) || !strcmp(arg, longName)) && value && ++i)
+    if (OPTION("-w", "--width")) options.w = atoi(value);
+    else if (OPTION("-h", "--height")) options.h = atoi(value);
+    else if (OPTION("-s", "--samples")) options.samplesCount = atoi(value);
+    else if (OPTION("-t", "--threads")) options.threadCount = atoi(value);
+    else if (OPTION("-o", "--output")) options.output = value;
+    else if (!strcmp(arg, "--simd")) options.simd = true;
+    else if (OPTION("", "--isa")) options.isa = value;
+    else if (OPTION("", "--marcher")) {
+      if (!strcmp(value, "classic")) options.marchStrategy = MARCH_CLASSIC;
+      else if (!strcmp(value, "relaxed")) options.marchStrategy = MARCH_RELAXED;
+      else return false;
+    }
+    else if (OPTION("", "--engine")) {
+      if (!strcmp(value, "megakernel")) options.wavefront = false;
+      else if (!strcmp(value, "wavefront")) options.wavefront = true;
+      else return false;
+    }
+    else if (OPTION("", "--min-samples")) options.minSamples = atoi(value);
+    else if (OPTION("", "--max-samples")) options.maxSamples = atoi(value);
+    else if (OPTION("", "--tolerance")) options.tolerance = atof(value);
+    else if (OPTION("", "--max-depth")) options.maxDepth = atoi(value);
+    else if (!strcmp(arg, "--roulette")) options.roulette = true;
+    else if (!strcmp(arg, "--mis")) options.mis = true;
+    else if (OPTION("", "--denoise")) options.denoise = atoi(value);
+    else if (!strcmp(arg, "--progressive")) options.progressive = true;
+    else if (OPTION("", "--budget")) options.budget = atof(value), options.progressive = true;
+    else if (OPTION("", "--checkpoint")) options.checkpoint = value;
+    else if (OPTION("", "--pass-samples")) options.passSamples = atoi(value);
+    else if (OPTION("", "--part")) {
+      char rest;
+      if (sscanf(value, "%d/%d%c", &options.partIndex, &options.partCount, &rest) != 2)
+        return false;
+    }
+    else if (!strcmp(arg, "--merge")) options.merge = true;
+    else if (options.merge && arg[0] != '-') options.mergeInputs.push_back(arg);
+    else if (!strcmp(arg, "--adaptive")) options.adaptive = true;
+    else if (!strcmp(arg, "--fd-normals")) options.finiteDifferenceNormals = true;
+    else if (!strcmp(arg, "--prepass")) options.prepass = true;
+    else if (OPTION("", "--sun-map")) options.sunMapSize = atoi(value);
+    else if (OPTION("", "--brick-map")) options.brickMapKb = atoi(value);
+    else if (!strcmp(arg, "--step-histogram")) options.stepHistogram = true;
+    else if (!strcmp(arg, "--bench")) options.bench = true;
+    else if (!strcmp(arg, "--heatmaps")) options.heatmaps = true;
+    else if (OPTION("", "--compare")) options.compare = value;
+    else if (OPTION("", "--min-psnr")) options.minPsnr = atof(value);
+    else if (OPTION("", "--psnr-block")) options.psnrBlock = atoi(value);
+    else if (!strcmp(arg, "--selftest")) options.selfTest = true;
+    else if (OPTION("", "--scene")) options.scene = value;
+    else if (!strcmp(arg, "--interpret")) options.interpret = true;
+    else return false;
+#undef OPTION
+  }
+  return true;
+}
+
+// Option values ParseOptions() read but cannot render with, each reported
+// on its own.
+bool CheckOptions(Options &options) {
+  const char* problem = NULL;
+  auto check = [&](bool ok, const char* message) { if (!ok && !problem) problem = message; };
+  check(options.w > 0 && options.h > 0, "--width and --height must be positive");
+  check(options.samplesCount > 0, "--samples must be positive");
+  check(options.threadCount >= 0, "--threads must not be negative");
+  check(options.sunMapSize >= 0, "--sun-map must not be negative");
+  check(options.brickMapKb >= 0, "--brick-map must not be negative");
+  check(!(options.brickMapKb && options.marchStrategy == MARCH_RELAXED),
+        "--brick-map needs the classic marcher");
+  check(options.psnrBlock > 0, "--psnr-block must be positive");
+  check(options.minSamples > 1, "--min-samples must be at least 2");
+  check(options.maxSamples >= options.minSamples, "--max-samples must be at least --min-samples");
+  check(options.tolerance > 0, "--tolerance must be positive");
+  check(options.passSamples > 0, "--pass-samples must be positive");
+  check(options.maxDepth > 0, "--max-depth must be positive");
+  check(options.denoise >= 0, "--denoise must not be negative");
+  check(!(options.denoise && options.checkpoint), "--denoise does not work with --checkpoint");
+  check(!(options.denoise && options.merge), "--denoise does not work with --merge");
+  check(options.budget >= 0, "--budget must not be negative");
+  check(!(options.progressive && options.checkpoint),
+        "--progressive and --budget do not work with --checkpoint");
+  check(!(options.progressive && options.adaptive),
+        "--progressive and --budget do not work with --adaptive");
+  check(!(options.progressive && options.merge),
+        "--progressive and --budget do not work with --merge");
+  bool stream = !strcmp(options.output, "-");
+  check(!(stream && options.checkpoint), "--checkpoint needs an output file, not -");
+  check(!(stream && options.merge), "--merge needs an output file, not -");
+  check(!(stream && options.compare), "--compare needs an output file, not -");
+  check(!(stream && options.heatmaps), "--heatmaps needs an output file, not -");
+  check(!(options.adaptive && options.checkpoint), "--adaptive does not work with --checkpoint");
+  check(!(options.adaptive && options.simd), "--adaptive does not work with --simd");
+  check(!(options.adaptive && options.wavefront), "--adaptive needs the megakernel engine");
+  check(options.partCount > 0 && options.partIndex >= 0 && options.partIndex < options.partCount,
+        "--part K/N needs 0 <= K < N");
+  check(options.partCount == 1 || options.checkpoint, "--part needs --checkpoint");
+  check(!options.merge || !options.mergeInputs.empty(), "--merge needs accumulation files");
+  check(!(options.heatmaps && options.simd), "--heatmaps does not work with --simd");
+  check(!(options.heatmaps && options.wavefront), "--heatmaps needs the megakernel engine");
+  check(!(options.scene && options.interpret), "--scene and --interpret exclude each other");
+  bool program = options.scene || options.interpret;
+  check(!(program && options.simd), "--scene and --interpret do not work with --simd");
+  check(!(program && options.mis), "--scene and --interpret do not work with --mis");
+  check(!(program && options.sunMapSize), "--scene and --interpret do not work with --sun-map");
+  if (problem) fprintf(stderr, "%s\n", problem);
+  return !problem;
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    PrintUsage();
+    return 1;
+  }
+  if (!CheckOptions(options)) return 1;
+
+  if (!SelectPacketIsa(options.isa)) {
+    fprintf(stderr, "Instruction set %s is unknown or not supported by this CPU\n", options.isa);
+    return 1;
+  }
+  if (options.simd && !packetIsa) {
+    fprintf(stderr, "--simd needs a build for x86\n");
+    return 1;
+  }
+
+  CompileScene();
+
+  int w = options.w, h = options.h;
+  Camera camera = MakeCamera(w, h);
+
+  if (options.merge) return MergeParts(camera, options) ? 0 : 1;
+
+  finiteDifferenceNormals = options.finiteDifferenceNormals;
+  marchStrategy = options.marchStrategy;
+  maxDepth = options.maxDepth;
+  russianRoulette = options.roulette, skyMis = options.mis;
+  pixelFootprint = camera.footprint;
+  if (options.selfTest) {
+    bool ok = SelfTestScene();
+    ok = SelfTestFastMath() && ok;
+    for (PacketIsa &isa : PacketIsas())
+      if (isa.supported) ok = SelfTestSimd(camera, isa) && ok;
+    ok = SelfTestGradient(camera) && ok;
+    ok = SelfTestPrepass(camera) && ok;
+    ok = SelfTestSunMap(camera) && ok;
+    ok = SelfTestBrickMap(camera) && ok;
+    ok = SelfTestWavefront(camera, options) && ok;
+    ok = SelfTestSink() && ok;
+    ok = SelfTestCheckpoint(camera, options) && ok;
+    ok = SelfTestDenoise(camera, options) && ok;
+    ok = SelfTestSampling(camera, options) && ok;
+    ok = SelfTestSceneProgram() && ok;
+    return ok ? 0 : 1;
+  }
+
+  if (options.scene ? !LoadScene(options.scene)
+      : options.interpret && !CompileSceneText(builtinScene, "builtin", sceneProgram))
+    return 1;
+
+  if (options.prepass) {
+    auto start = std::chrono::steady_clock::now();
+    depthPrepass.build(camera);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double sum = 0;
+    for (float t : depthPrepass.start) sum += t;
+    fprintf(stderr, "prepass: %d blocks, mean start distance %.2f, built in %.3f s\n",
+            (int)depthPrepass.start.size(), sum / depthPrepass.start.size(), elapsed.count());
+  }
+
+  if (options.sunMapSize) {
+    auto start = std::chrono::steady_clock::now();
+    sunMap.build(options.sunMapSize);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fprintf(stderr, "sun map: %dx%d cells of %.3f, built in %.2f s\n",
+            sunMap.size, sunMap.size, sunMap.cellSize, elapsed.count());
+  }
+
+  if (options.brickMapKb) {
+    auto start = std::chrono::steady_clock::now();
+    brickMap.build((size_t)options.brickMapKb << 10);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    long long empty = 0;
+    for (float bound : brickMap.bounds) empty += bound > 0;
+    fprintf(stderr, "brick map: %d bricks of %.3f, %.1f%% empty, built in %.2f s\n",
+            (int)brickMap.bounds.size(), brickMap.brickSize,
+            100. * empty / brickMap.bounds.size(), elapsed.count());
+  }
+
+  // Sized before any render: the step histogram renders too. Bench renders
+  // its own sizes and turns adaptive sampling off.
+  if (options.adaptive) sampleCounts.assign(w * h, 0);
+
+  if (options.stepHistogram) {
+    StepHistogram(camera, options);
+    return 0;
+  }
+
+  int threadCount = options.threadCount;
+  if (!threadCount) threadCount = std::thread::hardware_concurrency();
+  if (!threadCount) threadCount = 1;
+
+  if (options.bench) {
+    Bench(options, threadCount);
+    return 0;
+  }
+
+#if defined(INSTRUMENT)
+  if (options.heatmaps) pixelCosts.assign(w * h, PixelCost());
+#else
+  if (options.heatmaps) {
+    fprintf(stderr, "--heatmaps needs a build with -DINSTRUMENT\n");
+    return 1;
+  }
+#endif
+
+  if (options.checkpoint && !RenderCheckpointed(camera, options, threadCount)) return 1;
+  if (options.partCount > 1) return 0; // --merge writes the image.
+
+  // Accumulated images are written at the end, or after every pass.
+  bool toStdout = !strcmp(options.output, "-");
+  bool tilesToSink = !options.progressive && !options.denoise && !toStdout;
+  ImageSink sink;
+  if (tilesToSink && !sink.open(options.output, w, h)) {
+    fprintf(stderr, "cannot write %s\n", options.output);
+    return 1;
+  }
+
+#if defined(_WIN32)
+  _setmode(_fileno(stdout), _O_BINARY); // For PPM frames on stdout.
+#endif
+
+  if (options.progressive) {
+    if (!RenderProgressive(camera, options, threadCount)) {
+      fprintf(stderr, "cannot write %s\n", options.output);
+      return 1;
+    }
+  } else if (options.checkpoint) {
+    WriteAccumulation(camera, sink);
+  } else if (options.denoise || toStdout) {
+    accumulation.load(NULL, w, h);
+    if (options.denoise) features.reset(w, h);
+    RenderFrame(camera, options, threadCount, NULL);
+    if (!WriteFrame(camera, options, threadCount)) {
+      fprintf(stderr, "cannot write %s\n", options.output);
+      return 1;
+    }
+  } else {
+    RenderFrame(camera, options, threadCount, &sink);
+  }
+
+  if (sunMap.size) {
+    SunMapStats &t = sunMap.totals;
+    double rays = t.lit + t.shadowed + t.marched;
+    fprintf(stderr, "sun map: %.0f shadow rays, %.1f%% lit, %.1f%% shadowed, %.1f%% marched\n",
+            rays, 100 * t.lit / rays, 100 * t.shadowed / rays, 100 * t.marched / rays);
+  }
+
+  if (brickMap.on()) {
+    BrickStats &t = brickMap.totals;
+    double lookups = t.skipped + t.exact;
+    fprintf(stderr, "brick map: %.0f lookups, %.1f%% skipped a brick, %.1f%% fell back to the SDF\n",
+            lookups, 100 * t.skipped / lookups, 100 * t.exact / lookups);
+  }
+
+  if (options.adaptive) ReportSampleCounts(options);
+
+  if (tilesToSink && !sink.close()) {
+    fprintf(stderr, "cannot write %s\n", options.output);
+    return 1;
+  }
+
+#if defined(INSTRUMENT)
+  if (options.heatmaps && !WriteHeatmaps(camera, options)) {
+    fprintf(stderr, "cannot write the heatmaps\n");
+    return 1;
+  }
+#endif
+
+  if (options.compare && !CompareImages(camera, options)) return 2;
 }